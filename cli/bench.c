@@ -0,0 +1,174 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+
+/*
+ * sfs-bench times the index scanners behind query_next against each other
+ * on a synthetic index held in memory. Names are spread over 1000
+ * directories, so a directory prefix matches about one entry in a
+ * thousand and the scan itself dominates.
+ */
+
+static const char *scanners[] = { "scalar", "sse2", "avx2" };
+
+static double get_seconds(void)
+{
+    struct timespec spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+
+    return spec.tv_sec + (spec.tv_nsec / 1.0e9);
+}
+
+/**
+ * Fill an index of count entries: every 50th a directory, the rest files,
+ * with a deleted file now and then so the type test has work to do.
+ */
+static struct index_entry *make_index(long long count)
+{
+    struct index_entry *entries = calloc(count, sizeof(struct index_entry));
+
+    if (entries == NULL) {
+        return NULL;
+    }
+
+    for (long long i = 0; i < count; i++) {
+        struct index_entry *entry = &entries[i];
+
+        if (i % 50 == 0) {
+            entry->type = DIRECTORY_ENTRY;
+            snprintf(entry->dir.dir_name, sizeof(entry->dir.dir_name), "dir%03lld/sub%lld",
+                    i % 1000, i / 1000);
+        } else {
+            entry->type = i % 97 == 0 ? DEL_FILE_ENTRY : FILE_ENTRY;
+            snprintf(entry->file.file_name, sizeof(entry->file.file_name), "dir%03lld/file%07lld.dat",
+                    i % 1000, i % 10000000);
+        }
+    }
+
+    return entries;
+}
+
+/**
+ * Run the query rounds times, returning the matches of the last run and
+ * the best time per run through seconds.
+ */
+static long long run_query(filesystem *fs, uint32_t type_mask, const char *pattern,
+        int rounds, double *seconds)
+{
+    long long matches = 0;
+
+    *seconds = 0;
+    for (int r = 0; r < rounds; r++) {
+        query q;
+        double start = get_seconds(), elapsed;
+
+        matches = 0;
+        query_init(&q, fs, type_mask, pattern);
+        while (query_next(&q) != NULL) {
+            matches++;
+        }
+
+        elapsed = get_seconds() - start;
+        if (r == 0 || elapsed < *seconds) {
+            *seconds = elapsed;
+        }
+    }
+
+    return matches;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: sfs-bench [-n entries] [-r rounds] [pattern...]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static char *default_patterns[] = { "dir123/", "dir123/file0001", "dir123/*.dat", "" };
+    long long count = 1000000;
+    int rounds = 10, opt, npatterns;
+    char **patterns;
+    superblock s;
+    filesystem fs;
+
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        switch (opt) {
+            case 'n':
+                count = atoll(optarg);
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (count <= 0 || rounds <= 0) {
+        usage();
+    }
+
+    if (optind < argc) {
+        patterns = &argv[optind];
+        npatterns = argc - optind;
+    } else {
+        patterns = default_patterns;
+        npatterns = sizeof(default_patterns) / sizeof(default_patterns[0]);
+    }
+
+    memset(&s, 0, sizeof(s));
+    memset(&fs, 0, sizeof(fs));
+    s.index_bytes = count * INDEX_ENTRY_SIZE;
+    fs.s_block = &s;
+    fs.index_region = (char*)make_index(count);
+    if (fs.index_region == NULL) {
+        perror("Allocating index");
+        return 1;
+    }
+
+    printf("%lld entries (%lld MB), best of %d runs\n", count, s.index_bytes >> 20, rounds);
+    printf("%-20s %-8s %10s %10s %8s\n", "pattern", "scanner", "matches", "ms", "speedup");
+
+    for (int p = 0; p < npatterns; p++) {
+        // An empty pattern is a type-only query for files
+        const char *label = patterns[p][0] ? patterns[p] : "(files)";
+        uint32_t type_mask = TYPE_BIT(FILE_ENTRY) | (patterns[p][0] ? TYPE_BIT(DIRECTORY_ENTRY) : 0);
+        long long expected = -1;
+        double scalar_seconds = 0;
+
+        for (size_t i = 0; i < sizeof(scanners) / sizeof(scanners[0]); i++) {
+            long long matches;
+            double seconds;
+
+            if (!query_use_scanner(scanners[i])) {
+                printf("%-20s %-8s %10s\n", label, scanners[i], "n/a");
+                continue;
+            }
+
+            matches = run_query(&fs, type_mask, patterns[p], rounds, &seconds);
+            if (i == 0) {
+                expected = matches;
+                scalar_seconds = seconds;
+            }
+            printf("%-20s %-8s %10lld %10.3f %7.2fx\n", label, scanners[i], matches,
+                    seconds * 1000, scalar_seconds / seconds);
+
+            if (matches != expected) {
+                fprintf(stderr, "%s found %lld matches for %s, scalar found %lld\n",
+                        scanners[i], matches, patterns[p], expected);
+                return 1;
+            }
+        }
+    }
+
+    free(fs.index_region);
+    return 0;
+}
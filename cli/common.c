@@ -1,12 +1,17 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include <inttypes.h>
+#include <string.h>
 #include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
 
 #include "common.h"
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 uint8_t superblock_calc_checksum(superblock *s) 
 {
     uint8_t total = s->version + s->total_blocks + s->reserved_blocks + s->block_size;
@@ -31,3 +36,122 @@ long long get_media_size(superblock *s)
     return s->total_blocks * bytes_per_block;
 }
 
+
+long long get_name_hash_blocks(superblock *s)
+{
+    long bytes_per_block = 1 << (s->block_size + 7);
+    long long bytes = (long long)s->hash_slots * sizeof(name_hash_slot);
+    return (bytes + bytes_per_block - 1) / bytes_per_block;
+}
+
+static inline uint64_t mix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/**
+ * A fast 64 bit content hash, eight bytes per step. It isn't meant to
+ * stand up to an attacker, callers that can't tolerate a collision should
+ * compare the bytes as well.
+ */
+uint64_t hash_content(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    uint64_t k;
+
+    while (len >= 8) {
+        memcpy(&k, p, 8);
+        h = (h ^ mix64(k)) * 0x9e3779b97f4a7c15ULL;
+        h = (h << 27) | (h >> 37);
+        p += 8;
+        len -= 8;
+    }
+
+    k = 0;
+    memcpy(&k, p, len);
+    h ^= mix64(k ^ len);
+
+    return mix64(h);
+}
+
+long long get_checksum_blocks(superblock *s)
+{
+    long bytes_per_block = 1 << (s->block_size + 7);
+    long long bytes = s->data_blocks * sizeof(uint32_t);
+
+    if (!(s->features & SFS_FEATURE_CHECKSUMS)) {
+        return 0;
+    }
+    return (bytes + bytes_per_block - 1) / bytes_per_block;
+}
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_soft(uint32_t crc, const unsigned char *p, size_t len)
+{
+    if (crc32c_table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+            }
+            crc32c_table[i] = c;
+        }
+    }
+
+    while (len--) {
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t crc64 = crc;
+    uint64_t word;
+
+    while (len >= 8) {
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+
+    crc = (uint32_t)crc64;
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+
+    return crc;
+}
+#endif
+
+/**
+ * CRC32C as the kernel's crc32c() computes it: the caller supplies the
+ * seed, and there is no final inversion. Checksums are stored seeded with
+ * ~0, so the module can check them with crc32c(~0, block, len).
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+#if defined(__x86_64__)
+    static int have_sse42 = -1;
+
+    if (have_sse42 < 0) {
+        __builtin_cpu_init();
+        have_sse42 = __builtin_cpu_supports("sse4.2");
+    }
+    if (have_sse42) {
+        return crc32c_sse42(crc, data, len);
+    }
+#endif
+    return crc32c_soft(crc, data, len);
+}
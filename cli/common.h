@@ -12,10 +12,68 @@
 
 #include "../common/sfs.h"
 
+// Default number of name hash slots written by mksfs -H
+#define DEFAULT_HASH_SLOTS  256
+
+// Default stripe size for volume sets, as log2 of a block count (64KiB)
+#define DEFAULT_STRIPE_SHIFT    7
+
+// Bit for an entry type in a query type mask
+#define TYPE_BIT(type)      (1u << (type))
+
+/**
+ * Iterator over the index entries whose type is in type_mask and whose
+ * name matches pattern. A pattern with *, ? or [ is a glob, anything else
+ * is a name prefix. A backslash escapes the next character, as fnmatch
+ * does, so it makes the pattern a glob too. A NULL or empty pattern
+ * matches on type alone.
+ */
+typedef struct query {
+    filesystem *fs;
+    uint32_t type_mask;
+    const char *pattern;
+    size_t prefix_len;
+    int glob;
+    long long next;
+} query;
+
+/**
+ * A read-only window into a file inside a mapped image.
+ */
+typedef struct view {
+    const void *ptr;
+    size_t len;
+} view;
+
+/**
+ * A file being added to an image by mksfs. dup_of is the index of an
+ * earlier input with identical content, or -1.
+ */
+typedef struct input_file {
+    char *path;
+    char *name;
+    const char *data;
+    long long length;
+    uint64_t hash;
+    int dup_of;
+} input_file;
+
+// Access pattern hints for advise_view
+#define ADVISE_NORMAL       0
+#define ADVISE_SEQUENTIAL   1
+#define ADVISE_RANDOM       2
+#define ADVISE_WILLNEED     3
+#define ADVISE_HUGEPAGE     4
+
 // Definitions for functions related to userspace mapping of a filesystem
 filesystem *open_filesystem(char *fname);
+filesystem *open_filesystem_readonly(char *fname);
 filesystem *create_filesystem(int fd, superblock *s);
 filesystem *map_filesystem(int fd, superblock *s);
+filesystem *create_volume_set(int *fds, int count, superblock *s, long long index_blocks, int stripe_shift);
+char *get_data_block(filesystem *fs, long long block, long long *run);
+int get_data_location(filesystem *fs, long long block, long long *offset, long long *run);
+long long get_data_blocks(filesystem *fs);
 int close_filesystem(filesystem *fs);
 
 // Definitions for functions that can read/write a userspace filesystem
@@ -24,13 +82,39 @@ struct index_entry *find_directory(filesystem *fs, char *dname);
 struct index_entry *find_file(filesystem *fs, char *fname);
 int add_directory(filesystem *fs, char *dname);
 int add_file(filesystem *fs, char *fname, long long size);
+int add_shared_file(filesystem *fs, char *fname, index_entry *source);
 int write_file(filesystem *fs, index_entry *entry, char *data, long long len);
 int read_file(filesystem *fs, index_entry *entry, char *buf, long long bytes);
+int view_file(filesystem *fs, index_entry *entry, view *v);
+int view_file_range(filesystem *fs, index_entry *entry, long long offset, size_t len, view *v);
+int view_file_chunk(filesystem *fs, index_entry *entry, long long offset, view *v);
+int advise_view(const view *v, int advice);
+int build_name_hash(filesystem *fs);
+int build_checksums(filesystem *fs);
+void query_init(query *q, filesystem *fs, uint32_t type_mask, const char *pattern);
+struct index_entry *query_next(query *q);
+int query_use_scanner(const char *name);
+
+// Definitions for functions that load files to add to a filesystem
+int load_inputs(input_file *files, int count);
+void unload_inputs(input_file *files, int count);
+int find_duplicates(input_file *files, int count, int threads);
+
+// Image analysis
+int print_stats(filesystem *fs, int json);
+
+// Tar conversion
+int tar_to_image(int in_fd, int fd);
+int image_to_tar(filesystem *fs, int out_fd);
 
 // Helper functions
 uint8_t superblock_calc_checksum(superblock *s);
 long long get_milliseconds();
 long long get_media_size(superblock *s);
+long long get_name_hash_blocks(superblock *s);
+uint64_t hash_content(const void *data, size_t len);
+long long get_checksum_blocks(superblock *s);
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
 
 #endif	/* COMMON_H */
 
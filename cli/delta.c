@@ -0,0 +1,254 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "delta.h"
+
+/*
+ * sfs-delta compares two images and writes a patch holding only the
+ * blocks of the target that differ from the base. Files are matched by
+ * name first. A file whose extent, length and content are unchanged is
+ * skipped with a single compare, anything else is diffed block by block.
+ * Free data blocks are never shipped.
+ */
+
+typedef struct name_table {
+    struct index_entry **slots;
+    uint32_t mask;
+} name_table;
+
+static int name_table_init(name_table *t, filesystem *fs)
+{
+    long long entries = fs->s_block->index_bytes / INDEX_ENTRY_SIZE;
+    struct index_entry *entry = (struct index_entry*)fs->index_region;
+    uint32_t size = 16;
+
+    while (size < entries * 2) {
+        size <<= 1;
+    }
+
+    t->slots = calloc(size, sizeof(struct index_entry*));
+    if (t->slots == NULL) {
+        perror("Allocating name table");
+        return -1;
+    }
+    t->mask = size - 1;
+
+    for (long long i = 0; i < entries; i++, entry++) {
+        if (entry->type != FILE_ENTRY) {
+            continue;
+        }
+
+        uint32_t slot = sfs_name_hash(entry->file.file_name) & t->mask;
+        while (t->slots[slot] != NULL) {
+            slot = (slot + 1) & t->mask;
+        }
+        t->slots[slot] = entry;
+    }
+
+    return 0;
+}
+
+static struct index_entry *name_table_find(name_table *t, const char *name)
+{
+    uint32_t slot = sfs_name_hash(name) & t->mask;
+
+    for (; t->slots[slot] != NULL; slot = (slot + 1) & t->mask) {
+        if (strcmp(t->slots[slot]->file.file_name, name) == 0) {
+            return t->slots[slot];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Mark the blocks in [first, last] whose content differs between the two
+ * images. Blocks beyond the end of the base always differ.
+ */
+static void diff_blocks(filesystem *base, filesystem *target, long long first,
+        long long last, uint32_t bytes_per_block, unsigned char *changed)
+{
+    long long base_blocks = base->s_block->total_blocks;
+
+    for (long long b = first; b <= last; b++) {
+        if (changed[b]) {
+            continue;
+        }
+
+        if (b >= base_blocks ||
+                memcmp(base->map + (b * bytes_per_block), target->map + (b * bytes_per_block),
+                    bytes_per_block) != 0) {
+            changed[b] = 1;
+        }
+    }
+}
+
+static int file_unchanged(filesystem *base, filesystem *target, name_table *names,
+        struct index_entry *entry, uint32_t bytes_per_block)
+{
+    struct index_entry *old = name_table_find(names, entry->file.file_name);
+    long long offset = entry->file.starting_block * bytes_per_block;
+
+    if (old == NULL ||
+            old->file.starting_block != entry->file.starting_block ||
+            old->file.ending_block != entry->file.ending_block ||
+            old->file.length != entry->file.length ||
+            base->s_block->reserved_blocks != target->s_block->reserved_blocks) {
+        return 0;
+    }
+
+    if (base->data_region + offset + entry->file.length > base->index_region ||
+            target->data_region + offset + entry->file.length > target->index_region) {
+        return 0;
+    }
+
+    // Both images are mapped, so compare the bytes outright. A hash match
+    // alone could drop a changed file from the patch.
+    return memcmp(base->data_region + offset, target->data_region + offset,
+            entry->file.length) == 0;
+}
+
+static int write_runs(FILE *out, filesystem *target, unsigned char *changed,
+        uint32_t bytes_per_block, long long *shipped)
+{
+    long long total_blocks = target->s_block->total_blocks;
+    delta_run run;
+
+    for (long long b = 0; b < total_blocks; ) {
+        if (!changed[b]) {
+            b++;
+            continue;
+        }
+
+        run.block = b;
+        while (b < total_blocks && changed[b]) {
+            b++;
+        }
+        run.count = b - run.block;
+
+        if (fwrite(&run, sizeof(run), 1, out) != 1 ||
+                fwrite(target->map + (run.block * bytes_per_block), bytes_per_block,
+                    run.count, out) != (size_t)run.count) {
+            perror("Writing patch");
+            return -1;
+        }
+        *shipped += run.count;
+    }
+
+    memset(&run, 0, sizeof(run));
+    if (fwrite(&run, sizeof(run), 1, out) != 1) {
+        perror("Writing patch");
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    filesystem *base, *target;
+    name_table names;
+    delta_header header;
+    unsigned char *changed;
+    uint32_t bytes_per_block;
+    long long total_blocks, index_block, shipped = 0;
+    struct index_entry *entry;
+    FILE *out;
+    int ret = 1;
+
+    if (argc != 4) {
+        printf("Usage: %s <base image> <target image> <patch|->\n", argv[0]);
+        exit(1);
+    }
+
+    base = open_filesystem_readonly(argv[1]);
+    target = open_filesystem_readonly(argv[2]);
+    if (base == NULL || target == NULL) {
+        exit(1);
+    }
+
+    if (base->set_members > 1 || target->set_members > 1) {
+        printf("Volume sets aren't supported, only single images\n");
+        exit(1);
+    }
+
+    if (base->s_block->block_size != target->s_block->block_size) {
+        printf("Images use different block sizes\n");
+        exit(1);
+    }
+
+    bytes_per_block = 1 << (target->s_block->block_size + 7);
+    total_blocks = target->s_block->total_blocks;
+    changed = calloc(total_blocks, 1);
+    if (changed == NULL || name_table_init(&names, base) < 0) {
+        exit(1);
+    }
+
+    // The reserved blocks hold the superblock and any tables built from
+    // the index, and the index itself always changes along with any file.
+    diff_blocks(base, target, 0, target->s_block->reserved_blocks - 1, bytes_per_block, changed);
+    index_block = (target->index_region - target->map) / bytes_per_block;
+    diff_blocks(base, target, index_block, total_blocks - 1, bytes_per_block, changed);
+
+    // Only blocks that a live file points at are worth shipping.
+    entry = (struct index_entry*)target->index_region;
+    for (long long i = 0; i < target->s_block->index_bytes / INDEX_ENTRY_SIZE; i++, entry++) {
+        long long first, last;
+
+        if (entry->type != FILE_ENTRY || entry->file.length == 0) {
+            continue;
+        }
+
+        if (file_unchanged(base, target, &names, entry, bytes_per_block)) {
+            continue;
+        }
+
+        first = target->s_block->reserved_blocks + entry->file.starting_block;
+        last = target->s_block->reserved_blocks + entry->file.ending_block;
+        if (first < 0 || last >= index_block) {
+            printf("Skipping %s, its extent is outside the data region\n", entry->file.file_name);
+            continue;
+        }
+        diff_blocks(base, target, first, last, bytes_per_block, changed);
+    }
+
+    if (strcmp(argv[3], "-") == 0) {
+        out = stdout;
+    } else {
+        out = fopen(argv[3], "wb");
+        if (out == NULL) {
+            perror("Opening patch");
+            exit(1);
+        }
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DELTA_MAGIC, sizeof(header.magic));
+    header.block_bytes = bytes_per_block;
+    header.base_total_blocks = base->s_block->total_blocks;
+    header.base_id = image_id(base);
+    header.target_total_blocks = total_blocks;
+    header.target_id = image_id(target);
+
+    if (fwrite(&header, sizeof(header), 1, out) == 1 &&
+            write_runs(out, target, changed, bytes_per_block, &shipped) == 0) {
+        fprintf(stderr, "%lld of %lld blocks changed (%lld bytes)\n",
+                shipped, total_blocks, shipped * bytes_per_block);
+        ret = 0;
+    }
+
+    if (fclose(out) != 0) {
+        perror("Closing patch");
+        ret = 1;
+    }
+    free(names.slots);
+    free(changed);
+    close_filesystem(base);
+    close_filesystem(target);
+
+    return ret;
+}
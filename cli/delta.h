@@ -0,0 +1,44 @@
+/* 
+ * File:   delta.h
+ *
+ * Patch format shared by sfs-delta and sfs-patch. A patch is a header
+ * followed by runs of whole blocks in ascending order, each run followed
+ * by its data. A run with a count of zero ends the patch.
+ */
+
+#ifndef DELTA_H
+#define	DELTA_H
+
+#include "common.h"
+
+#define DELTA_MAGIC         "SFSDELT1"
+
+typedef struct __attribute__((__packed__)) delta_header {
+    char magic[8];
+    uint32_t block_bytes;
+    long long base_total_blocks;
+    uint64_t base_id;
+    long long target_total_blocks;
+    uint64_t target_id;
+} delta_header;
+
+typedef struct __attribute__((__packed__)) delta_run {
+    long long block;
+    long long count;
+} delta_run;
+
+/**
+ * Identify an image by its first block, which holds the superblock, and
+ * its index. A patch is only applied to an image with the same metadata as
+ * the one it was made against. File data isn't covered, which is cheap to
+ * check and makes applying the same patch twice harmless.
+ */
+static inline uint64_t image_id(filesystem *fs)
+{
+    uint32_t bytes_per_block = 1 << (fs->s_block->block_size + 7);
+
+    return hash_content(fs->map, bytes_per_block) ^
+        (hash_content(fs->index_region, fs->s_block->index_bytes) * 0x9e3779b97f4a7c15ULL);
+}
+
+#endif	/* DELTA_H */
@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/*
+ * sfs-httpbench is a loopback load generator for sfs-serve. Each thread
+ * keeps one connection open and fetches the given paths in turn, one
+ * request at a time, until the time is up. Requests per second and
+ * throughput are reported at the end.
+ */
+
+#define RESPONSE_MAX    8192
+#define DRAIN_MAX       (256 * 1024)
+
+typedef struct bench {
+    int port;
+    char **paths;
+    int npaths;
+    double deadline;
+} bench;
+
+typedef struct client {
+    bench *b;
+    int id;
+    long long requests;
+    long long bytes;
+    int failed;
+} client;
+
+static double get_seconds(void)
+{
+    struct timespec spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+
+    return spec.tv_sec + (spec.tv_nsec / 1.0e9);
+}
+
+static int connect_loopback(int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return fd;
+}
+
+/**
+ * Send one GET and read the whole response, discarding the body.
+ * Returns the body length, or -1 on an error or a status other than 200.
+ */
+static long long fetch(int fd, const char *path, char *buf, char *drain)
+{
+    size_t len = 0;
+    long long body, left;
+    ssize_t n;
+    char *end, *value;
+
+    n = snprintf(buf, RESPONSE_MAX, "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", path);
+    if (send(fd, buf, n, 0) != n) {
+        return -1;
+    }
+
+    for (;;) {
+        n = recv(fd, buf + len, RESPONSE_MAX - 1 - len, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        len += n;
+        buf[len] = '\0';
+
+        end = strstr(buf, "\r\n\r\n");
+        if (end != NULL) {
+            break;
+        }
+        if (len == RESPONSE_MAX - 1) {
+            return -1;
+        }
+    }
+
+    value = strcasestr(buf, "\r\nContent-Length:");
+    if (strncmp(buf, "HTTP/1.1 200 ", 13) != 0 || value == NULL || value > end) {
+        return -1;
+    }
+    body = atoll(value + 17);
+
+    // Whatever arrived past the headers is the start of the body
+    left = body - (long long)(buf + len - (end + 4));
+    while (left > 0) {
+        n = recv(fd, drain, left < DRAIN_MAX ? left : DRAIN_MAX, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        left -= n;
+    }
+
+    return body;
+}
+
+static void *run_client(void *arg)
+{
+    client *cl = arg;
+    bench *b = cl->b;
+    char *buf = malloc(RESPONSE_MAX);
+    char *drain = malloc(DRAIN_MAX);
+    int fd = connect_loopback(b->port);
+    long long body;
+
+    if (fd < 0 || buf == NULL || drain == NULL) {
+        cl->failed = 1;
+        goto out;
+    }
+
+    for (long long i = cl->id; get_seconds() < b->deadline; i++) {
+        body = fetch(fd, b->paths[i % b->npaths], buf, drain);
+        if (body < 0) {
+            cl->failed = 1;
+            break;
+        }
+        cl->requests++;
+        cl->bytes += body;
+    }
+
+out:
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buf);
+    free(drain);
+    return NULL;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: sfs-httpbench [-p port] [-c connections] [-d seconds] path...\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    bench b;
+    client *clients;
+    pthread_t *threads;
+    int connections = 4, seconds = 5, opt, failed = 0;
+    long long requests = 0, bytes = 0;
+    double start, elapsed;
+
+    memset(&b, 0, sizeof(b));
+    b.port = 8080;
+
+    while ((opt = getopt(argc, argv, "p:c:d:")) != -1) {
+        switch (opt) {
+            case 'p':
+                b.port = atoi(optarg);
+                break;
+            case 'c':
+                connections = atoi(optarg);
+                break;
+            case 'd':
+                seconds = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind >= argc || connections < 1 || seconds < 1) {
+        usage();
+    }
+    b.paths = &argv[optind];
+    b.npaths = argc - optind;
+
+    clients = calloc(connections, sizeof(client));
+    threads = calloc(connections, sizeof(pthread_t));
+    if (clients == NULL || threads == NULL) {
+        perror("Starting clients");
+        return 1;
+    }
+
+    start = get_seconds();
+    b.deadline = start + seconds;
+    for (int i = 0; i < connections; i++) {
+        clients[i].b = &b;
+        clients[i].id = i;
+        if (pthread_create(&threads[i], NULL, run_client, &clients[i]) != 0) {
+            perror("Starting clients");
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < connections; i++) {
+        pthread_join(threads[i], NULL);
+        requests += clients[i].requests;
+        bytes += clients[i].bytes;
+        failed += clients[i].failed;
+    }
+    elapsed = get_seconds() - start;
+
+    printf("%d connections, %.1f s: %lld requests, %.0f req/s, %.1f MB/s\n",
+            connections, elapsed, requests, requests / elapsed, bytes / elapsed / (1 << 20));
+    if (failed) {
+        fprintf(stderr, "%d connections failed\n", failed);
+        return 1;
+    }
+
+    free(clients);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,169 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "common.h"
+
+/*
+ * Files given to mksfs on the command line. Each one is mapped read only
+ * rather than copied, and can be checked against the others for identical
+ * content so duplicates share a single extent in the image.
+ */
+
+/**
+ * Turn a path into an SFS name. The namespace is flat, so the path is kept
+ * as is apart from any leading "/" or "./".
+ */
+static char *input_name(char *path)
+{
+    while (*path == '/' || (path[0] == '.' && path[1] == '/')) {
+        path += (*path == '/') ? 1 : 2;
+    }
+
+    return path;
+}
+
+int load_inputs(input_file *files, int count)
+{
+    struct stat st;
+    int fd;
+
+    for (int i = 0; i < count; i++) {
+        files[i].name = input_name(files[i].path);
+        files[i].data = NULL;
+        files[i].dup_of = -1;
+
+        if (strlen(files[i].name) == 0 ||
+                strlen(files[i].name) >= sizeof(((struct file_entry*)0)->file_name)) {
+            printf("%s: name must be 1 to %zu characters\n", files[i].path,
+                    sizeof(((struct file_entry*)0)->file_name) - 1);
+            return -1;
+        }
+
+        fd = open(files[i].path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror(files[i].path);
+            return -1;
+        }
+
+        files[i].length = st.st_size;
+        if (st.st_size > 0) {
+            files[i].data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (files[i].data == MAP_FAILED) {
+                perror(files[i].path);
+                files[i].data = NULL;
+                close(fd);
+                return -1;
+            }
+        }
+        close(fd);
+    }
+
+    return 0;
+}
+
+void unload_inputs(input_file *files, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (files[i].data != NULL) {
+            munmap((void*)files[i].data, files[i].length);
+        }
+    }
+}
+
+typedef struct hash_job {
+    input_file *files;
+    int count;
+    int first;
+    int stride;
+} hash_job;
+
+static void *hash_inputs(void *arg)
+{
+    hash_job *job = arg;
+
+    for (int i = job->first; i < job->count; i += job->stride) {
+        job->files[i].hash = hash_content(job->files[i].data, job->files[i].length);
+    }
+
+    return NULL;
+}
+
+/**
+ * Hash every input across threads, then point each file whose content
+ * matches an earlier one at that file through dup_of. Equal hashes are
+ * confirmed byte for byte before two files are treated as the same.
+ * Returns the number of duplicates found.
+ */
+int find_duplicates(input_file *files, int count, int threads)
+{
+    pthread_t *ids = calloc(threads, sizeof(pthread_t));
+    hash_job *jobs = calloc(threads, sizeof(hash_job));
+    uint32_t size = 16, mask, slot;
+    int *table, started = 0, dups = 0;
+
+    if (ids == NULL || jobs == NULL) {
+        perror("Allocating hash threads");
+        free(ids);
+        free(jobs);
+        return -1;
+    }
+
+    for (int t = 0; t < threads; t++) {
+        jobs[t] = (hash_job){ files, count, t, threads };
+        if (pthread_create(&ids[t], NULL, hash_inputs, &jobs[t]) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    // If a thread couldn't be started, hash its share here
+    for (int t = started; t < threads; t++) {
+        hash_inputs(&jobs[t]);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(ids[t], NULL);
+    }
+    free(ids);
+    free(jobs);
+
+    while (size < (uint32_t)count * 2) {
+        size <<= 1;
+    }
+    mask = size - 1;
+
+    table = malloc(size * sizeof(int));
+    if (table == NULL) {
+        perror("Allocating duplicate table");
+        return -1;
+    }
+    memset(table, 0xff, size * sizeof(int));
+
+    for (int i = 0; i < count; i++) {
+        for (slot = files[i].hash & mask; table[slot] >= 0; slot = (slot + 1) & mask) {
+            input_file *other = &files[table[slot]];
+
+            if (other->hash == files[i].hash && other->length == files[i].length &&
+                    (files[i].length == 0 || memcmp(other->data, files[i].data, files[i].length) == 0)) {
+                files[i].dup_of = table[slot];
+                dups++;
+                break;
+            }
+        }
+
+        if (files[i].dup_of < 0) {
+            table[slot] = i;
+        }
+    }
+
+    free(table);
+    return dups;
+}
@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <inttypes.h>
 #include <getopt.h>
@@ -12,31 +14,255 @@
 #include "../common/sfs.h"
 
 
-int create_fs(char *fname)
+/**
+ * Add the input files to a new image. Duplicates found by find_duplicates
+ * share the extent of the first copy instead of being written again.
+ */
+int add_inputs(filesystem *fs, input_file *files, int count)
+{
+    struct index_entry *entry;
+
+    for (int i = 0; i < count; i++) {
+        if (files[i].dup_of >= 0) {
+            entry = find_file(fs, files[files[i].dup_of].name);
+            if (entry == NULL || add_shared_file(fs, files[i].name, entry) < 0) {
+                printf("Could not add %s\n", files[i].path);
+                return -1;
+            }
+            continue;
+        }
+
+        if (add_file(fs, files[i].name, files[i].length) < 0) {
+            printf("Could not add %s\n", files[i].path);
+            return -1;
+        }
+
+        entry = find_file(fs, files[i].name);
+        if (entry == NULL || write_file(fs, entry, (char*)files[i].data, files[i].length) < 0) {
+            printf("Could not write %s\n", files[i].path);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Create the image, or with a comma separated list of names, a volume set
+ * striped across all of them.
+ */
+static filesystem *create_images(char *fname, superblock *s, long long index_blocks)
+{
+    int fds[255];
+    int count = 0;
+    char *names, *name, *save = NULL;
+    filesystem *fs = NULL;
+
+    if (strchr(fname, ',') == NULL) {
+        fds[0] = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fds[0] < 0) {
+            perror("File open");
+            return NULL;
+        }
+        fs = create_filesystem(fds[0], s);
+        if (fs == NULL) {
+            close(fds[0]);
+        }
+        return fs;
+    }
+
+    names = strdup(fname);
+    for (name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        if (count == 255) {
+            printf("A volume set can have at most 255 images\n");
+            goto out;
+        }
+        fds[count] = open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fds[count] < 0) {
+            perror(name);
+            goto out;
+        }
+        count++;
+    }
+
+    fs = create_volume_set(fds, count, s, index_blocks, DEFAULT_STRIPE_SHIFT);
+out:
+    if (fs == NULL) {
+        for (int i = 0; i < count; i++) {
+            close(fds[i]);
+        }
+    }
+    free(names);
+    return fs;
+}
+
+/**
+ * Remove the image, or each image of a volume set.
+ */
+static void remove_images(char *fname)
+{
+    char *names = strdup(fname), *name, *save = NULL;
+
+    if (names == NULL) {
+        return;
+    }
+    for (name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        unlink(name);
+    }
+    free(names);
+}
+
+int create_fs(char *fname, int hash_flag, int csum_flag, int dedup_flag, char **paths, int count)
 {
-    int fd;
     superblock s;
     filesystem *fs;
+    input_file *files = calloc(count + 1, sizeof(input_file));
+    long long bytes_per_block = 512;
+    long long data_blocks = 2;      // Used by the default files
+    long long entries = 9;          // Marker, volume ID, 5 directories and 2 files
+    long long index_blocks, needed;
     
+    for (int i = 0; i < count; i++) {
+        files[i].path = paths[i];
+    }
+    if (load_inputs(files, count) < 0) {
+        unload_inputs(files, count);
+        free(files);
+        return -1;
+    }
+
+    if (dedup_flag && count > 1) {
+        long threads = sysconf(_SC_NPROCESSORS_ONLN);
+        int dups = find_duplicates(files, count, threads > 0 ? threads : 1);
+        if (dups > 0) {
+            printf("%d duplicate files will share extents\n", dups);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (files[i].dup_of < 0) {
+            data_blocks += files[i].length > 0 ? (files[i].length + bytes_per_block - 1) / bytes_per_block : 1;
+        }
+    }
+    entries += count;
+    index_blocks = (entries * INDEX_ENTRY_SIZE + bytes_per_block - 1) / bytes_per_block;
+
     memset(&s, 0, sizeof(superblock));
     s.block_size = 2;
     s.total_blocks = 100;
     s.data_blocks = 80;
+    if (hash_flag) {
+        s.features |= SFS_FEATURE_NAME_HASH;
+        s.hash_slots = DEFAULT_HASH_SLOTS;
+        while (s.hash_slots < entries * 2) {
+            s.hash_slots <<= 1;
+        }
+    }
+
+    if (csum_flag) {
+        s.features |= SFS_FEATURE_CHECKSUMS;
+    }
+
+    // Grow the image past the default size if the inputs need it
+    if (data_blocks > s.data_blocks) {
+        s.data_blocks = data_blocks;
+    }
+    needed = 1 + get_name_hash_blocks(&s) + get_checksum_blocks(&s) + s.data_blocks + index_blocks + 1;
+    if (needed > s.total_blocks) {
+        s.total_blocks = needed;
+    }
+
+    fs = create_images(fname, &s, index_blocks);
+    if (fs == NULL) {
+        unload_inputs(files, count);
+        free(files);
+        return -1;
+    }
+    if (add_inputs(fs, files, count) < 0) {
+        // Don't leave a half populated image behind
+        close_filesystem(fs);
+        remove_images(fname);
+        unload_inputs(files, count);
+        free(files);
+        return -1;
+    }
+    build_name_hash(fs);
+    build_checksums(fs);
+    close_filesystem(fs);
+    unload_inputs(files, count);
+    free(files);
+    
+    return 1;
+}
+
+/**
+ * Build an image from a tar stream, read from stdin if tar_name is "-".
+ */
+int from_tar_fs(char *fname, char *tar_name)
+{
+    int in_fd = STDIN_FILENO;
+    int fd, count;
+
+    if (strcmp(tar_name, "-") != 0) {
+        in_fd = open(tar_name, O_RDONLY);
+        if (in_fd < 0) {
+            perror(tar_name);
+            return -1;
+        }
+    }
 
     fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0600);
     if (fd < 0) {
         perror("File open");
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
         return -1;
     }
 
-    fs = create_filesystem(fd, &s);
-    if (fs == NULL) {
-        close(fd);
+    count = tar_to_image(in_fd, fd);
+    close(fd);
+    if (in_fd != STDIN_FILENO) {
+        close(in_fd);
+    }
+    if (count < 0) {
         return -1;
     }
+
+    printf("Added %d entries\n", count);
+    return 0;
+}
+
+/**
+ * Write an image out as a tar stream, to stdout if tar_name is "-".
+ */
+int to_tar_fs(char *fname, char *tar_name)
+{
+    filesystem *fs;
+    int out_fd = STDOUT_FILENO;
+    int ret;
+
+    fs = open_filesystem_readonly(fname);
+    if (fs == NULL) {
+        exit(1);
+    }
+
+    if (strcmp(tar_name, "-") != 0) {
+        out_fd = open(tar_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0) {
+            perror(tar_name);
+            close_filesystem(fs);
+            return -1;
+        }
+    }
+
+    ret = image_to_tar(fs, out_fd);
+    if (out_fd != STDOUT_FILENO) {
+        close(out_fd);
+    }
     close_filesystem(fs);
-    
-    return 1;
+
+    return ret;
 }
 
 int open_fs(char *fname)
@@ -60,20 +286,128 @@ int open_fs(char *fname)
     strftime(fmt, sizeof(fmt), "%Y-%m-%d %H:%M:%S", tm);
     printf("Opened filesystem ID %s\n", vei_ptr->volume_id.volume_name);
     printf("Created at %s\n", fmt);
+    if (fs->set_members > 1) {
+        printf("Volume set of %d images, striped every %lld blocks\n",
+                fs->set_members, 1LL << fs->stripe_shift);
+    }
     close_filesystem(fs);
     
     return 0;
 }
 
+int list_fs(char *fname, char *pattern)
+{
+    filesystem *fs;
+    query q;
+    struct index_entry *entry;
+
+    fs = open_filesystem(fname);
+    if (fs == NULL) {
+        exit(1);
+    }
+
+    query_init(&q, fs, TYPE_BIT(DIRECTORY_ENTRY) | TYPE_BIT(FILE_ENTRY), pattern);
+    while ((entry = query_next(&q)) != NULL) {
+        if (entry->type == DIRECTORY_ENTRY) {
+            printf("%s/\n", entry->dir.dir_name);
+        } else {
+            printf("%s\t%lld\n", entry->file.file_name, entry->file.length);
+        }
+    }
+    close_filesystem(fs);
+
+    return 0;
+}
+
+int cat_fs(char *fname, char *name)
+{
+    filesystem *fs;
+    struct index_entry *entry;
+    long long offset;
+    view v;
+
+    fs = open_filesystem_readonly(fname);
+    if (fs == NULL) {
+        exit(1);
+    }
+
+    entry = find_file(fs, name);
+    if (entry == NULL || view_file_chunk(fs, entry, 0, &v) < 0) {
+        printf("No readable file named %s\n", name);
+        close_filesystem(fs);
+        return -1;
+    }
+
+    // A file in a volume set is in pieces across the images. Ask for all of
+    // them up front so every device reads at once.
+    if (fs->set_members > 1) {
+        for (offset = 0; offset < entry->file.length; offset += v.len) {
+            if (view_file_chunk(fs, entry, offset, &v) < 0 || v.len == 0) {
+                break;
+            }
+            advise_view(&v, ADVISE_WILLNEED);
+        }
+    }
+
+    for (offset = 0; offset < entry->file.length; offset += v.len) {
+        if (view_file_chunk(fs, entry, offset, &v) < 0 || v.len == 0) {
+            printf("%s is cut short at %lld bytes\n", name, offset);
+            close_filesystem(fs);
+            return -1;
+        }
+        advise_view(&v, ADVISE_SEQUENTIAL);
+        fwrite(v.ptr, 1, v.len, stdout);
+    }
+    close_filesystem(fs);
+
+    return 0;
+}
+
+int stat_fs(char *fname, int json)
+{
+    filesystem *fs;
+    int ret;
+
+    fs = open_filesystem_readonly(fname);
+    if (fs == NULL) {
+        exit(1);
+    }
+
+    ret = print_stats(fs, json);
+    close_filesystem(fs);
+
+    return ret;
+}
+
 int main(int argc, char **argv)
 {
     int c;
     int create_flag = 0;
     int open_flag = 0;
+    int hash_flag = 0;
+    int dedup_flag = 0;
+    int csum_flag = 0;
+    int stat_flag = 0;
+    int json_flag = 0;
     char *fname = NULL;
+    char *pattern = NULL;
+    char *read_name = NULL;
+    char *from_tar = NULL;
+    char *to_tar = NULL;
+    static struct option long_options[] = {
+        {"from-tar", required_argument, NULL, 'T'},
+        {"to-tar", required_argument, NULL, 'X'},
+        {NULL, 0, NULL, 0}
+    };
 
-    while ((c = getopt(argc, argv, "cof:")) != -1) {
+    while ((c = getopt_long(argc, argv, "cof:HCDl:r:sj", long_options, NULL)) != -1) {
         switch (c) {
+            case 'T':
+                from_tar = optarg;
+                break;
+            case 'X':
+                to_tar = optarg;
+                break;
             case 'c':
                 create_flag = 1;
                 break;
@@ -83,6 +417,27 @@ int main(int argc, char **argv)
             case 'f':
                 fname = optarg;
                 break;
+            case 'H':
+                hash_flag = 1;
+                break;
+            case 'C':
+                csum_flag = 1;
+                break;
+            case 'D':
+                dedup_flag = 1;
+                break;
+            case 's':
+                stat_flag = 1;
+                break;
+            case 'j':
+                json_flag = 1;
+                break;
+            case 'l':
+                pattern = optarg;
+                break;
+            case 'r':
+                read_name = optarg;
+                break;
             default:
                 abort();
         }
@@ -98,13 +453,37 @@ int main(int argc, char **argv)
         exit(1);
     }
 
+    if (from_tar != NULL) {
+        if (create_flag || hash_flag || csum_flag || dedup_flag || strchr(fname, ',') != NULL) {
+            printf("--from-tar can't be combined with -c, -H, -C, -D or a volume set\n");
+            exit(1);
+        }
+        exit(from_tar_fs(fname, from_tar) < 0);
+    }
+
+    if (to_tar != NULL) {
+        exit(to_tar_fs(fname, to_tar) < 0);
+    }
+
     if (create_flag) {
-        create_fs(fname);
-        exit(1);
+        exit(create_fs(fname, hash_flag, csum_flag, dedup_flag, argv + optind, argc - optind) < 0);
     }
     
     if (open_flag) {
         open_fs(fname);
         exit(1);
     }
+
+    if (pattern != NULL) {
+        list_fs(fname, pattern);
+        exit(0);
+    }
+
+    if (stat_flag) {
+        exit(stat_fs(fname, json_flag) < 0);
+    }
+
+    if (read_name != NULL) {
+        exit(cat_fs(fname, read_name) < 0);
+    }
 }
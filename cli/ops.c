@@ -1,4 +1,14 @@
-#include "sfs.h"
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "common.h"
 
 struct index_entry *find_directory(filesystem *fs, char *dname)
 {
@@ -33,39 +43,286 @@ struct index_entry *find_file(filesystem *fs, char *fname)
 
 int add_directory(filesystem *fs, char *dname)
 {
+	if (strlen(dname) >= sizeof(((struct dir_entry*)0)->dir_name)) {
+		return -1;
+	}
+
 	if (find_directory(fs, dname)!=NULL) {
 		return -1;
 	}
 
-	add_index_entry(fs, DIRECTORY_ENTRY);
+	struct index_entry *entry = add_index_entry(fs, DIRECTORY_ENTRY);
+	strcpy(entry->dir.dir_name, dname);
+	entry->dir.timestamp = get_milliseconds();
+	entry->dir.continuation_entries = 0;
 	return 0;
 }
 
 int add_file(filesystem *fs, char *fname, long long size)
 {
-	uint32_t bytes_per_block = 1 << (s->block_size + 7);
+	uint32_t bytes_per_block = 1 << (fs->s_block->block_size + 7);
+	long long blocks = size > 0 ? (size + bytes_per_block - 1) / bytes_per_block : 1;
+
+	if (strlen(fname) >= sizeof(((struct file_entry*)0)->file_name)) {
+		return -1;
+	}
 
 	if (find_file(fs, fname)!=NULL) {
 		return -1;
 	}
 
+	// The starting marker always sits at the bottom of the index, so it
+	// has to be looked up again once the new entry has pushed it down.
+	struct index_entry *entry = add_index_entry(fs, FILE_ENTRY);
 	struct index_entry *marker = (struct index_entry *)fs->index_region;
+
+	strcpy(entry->file.file_name, fname);
+	entry->file.timestamp = get_milliseconds();
+	entry->file.continuation_entries = 0;
+	entry->file.length = size;
+	entry->file.starting_block = marker->first_entry.next_starting_block;
+	entry->file.ending_block = entry->file.starting_block + blocks - 1;
+	marker->first_entry.next_starting_block = entry->file.ending_block + 1;
+	return 0;
+}
+
+/**
+ * Add a file that shares the extent of an existing one. SFS is read only,
+ * so any number of entries can point at the same blocks.
+ */
+int add_shared_file(filesystem *fs, char *fname, index_entry *source)
+{
+	if (strlen(fname) >= sizeof(((struct file_entry*)0)->file_name)) {
+		return -1;
+	}
+
+	if (source->type != FILE_ENTRY || find_file(fs, fname)!=NULL) {
+		return -1;
+	}
+
 	struct index_entry *entry = add_index_entry(fs, FILE_ENTRY);
-	entry->starting_block = marker->first_entry.next_starting_block;
-	entry->ending_block = entry->starting_block + (size / bytes_per_block) + 1;
+
+	strcpy(entry->file.file_name, fname);
+	entry->file.timestamp = get_milliseconds();
+	entry->file.continuation_entries = 0;
+	entry->file.length = source->file.length;
+	entry->file.starting_block = source->file.starting_block;
+	entry->file.ending_block = source->file.ending_block;
+	return 0;
 }
 
-int write_file(filesystem *fs, index_entry *entry, char *data, long long len)
+/*
+ * A copy between a buffer and the blocks of a file. With member set to an
+ * image of a volume set, only the stripes held by that image are copied,
+ * so one job per member can run in parallel. -1 copies everything.
+ */
+typedef struct copy_job {
+	filesystem *fs;
+	index_entry *entry;
+	char *buf;
+	long long bytes;
+	int member;
+	int to_image;
+	int err;
+} copy_job;
+
+static void *copy_runs(void *arg)
+{
+	copy_job *job = arg;
+	filesystem *fs = job->fs;
+	uint32_t bytes_per_block = 1 << (fs->s_block->block_size + 7);
+	long long done = 0, run, len, block;
+	char *data;
+
+	while (done < job->bytes) {
+		block = job->entry->file.starting_block + (done / bytes_per_block);
+		data = get_data_block(fs, block, &run);
+		if (data == NULL) {
+			job->err = -1;
+			break;
+		}
+
+		len = run * bytes_per_block;
+		if (len > job->bytes - done) {
+			len = job->bytes - done;
+		}
+
+		if (job->member < 0 || (block >> fs->stripe_shift) % fs->set_members == job->member) {
+			if (job->to_image) {
+				memcpy(data, job->buf + done, len);
+			} else {
+				memcpy(job->buf + done, data, len);
+			}
+		}
+		done += len;
+	}
+
+	return NULL;
+}
+
+/**
+ * Copy a file in or out. Files spanning more than one stripe of a volume
+ * set are copied by a thread per image, so every device works at once.
+ */
+static int copy_file(filesystem *fs, index_entry *entry, char *buf, long long bytes, int to_image)
 {
-	uint32_t bytes_per_block = 1 << (s->block_size + 7);
+	uint32_t bytes_per_block = 1 << (fs->s_block->block_size + 7);
+	copy_job jobs[256];
+	pthread_t threads[256];
+	int started[256];
+	int count = 1, err = 0;
+
+	if (fs->set_members > 1 && bytes > ((long long)bytes_per_block << fs->stripe_shift)) {
+		count = fs->set_members;
+	}
+
+	for (int i = 0; i < count; i++) {
+		jobs[i] = (copy_job){ fs, entry, buf, bytes, count > 1 ? i : -1, to_image, 0 };
+	}
+
+	if (count == 1) {
+		copy_runs(&jobs[0]);
+		return jobs[0].err;
+	}
+
+	for (int i = 0; i < count; i++) {
+		started[i] = pthread_create(&threads[i], NULL, copy_runs, &jobs[i]) == 0;
+		if (!started[i]) {
+			// Fall back to copying this member's share here
+			copy_runs(&jobs[i]);
+		}
+	}
+	for (int i = 0; i < count; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+		}
+		err |= jobs[i].err;
+	}
 
-	char *dest = (char*)(fs->data_region + (entry->file.starting_block * bytes_per_block));
-	memcpy(dest, data, len);
+	return err;
+}
+
+int write_file(filesystem *fs, index_entry *entry, char *data, long long len)
+{
+	return copy_file(fs, entry, data, len, 1);
 }
 
 int read_file(filesystem *fs, index_entry *entry, char *buf, long long bytes)
 {
-	char *src = (char*)(fs->data_region + (entry->file.starting_block * bytes_per_block));
-	memcpy(buf, src, bytes);
+	return copy_file(fs, entry, buf, bytes, 0);
+}
+
+/**
+ * Point a view at part of a file, straight into the mapped image. Nothing
+ * is copied, so the view is only valid until the filesystem is closed.
+ * A range that crosses stripes of a volume set isn't contiguous, and fails
+ * with EXDEV; view_file_chunk walks those a piece at a time.
+ */
+int view_file_range(filesystem *fs, index_entry *entry, long long offset, size_t len, view *v)
+{
+	uint32_t bytes_per_block = 1 << (fs->s_block->block_size + 7);
+	long long run;
+	char *start;
+
+	if (entry->type != FILE_ENTRY || offset < 0 || offset > entry->file.length) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (len > entry->file.length - offset) {
+		len = entry->file.length - offset;
+	}
+
+	if (len == 0) {
+		v->ptr = fs->data_region;
+		v->len = 0;
+		return 0;
+	}
+
+	start = get_data_block(fs, entry->file.starting_block + (offset / bytes_per_block), &run);
+	if (start == NULL) {
+		errno = ERANGE;
+		return -1;
+	}
+	if ((offset % bytes_per_block) + len > run * bytes_per_block) {
+		errno = fs->set_members > 1 ? EXDEV : ERANGE;
+		return -1;
+	}
+
+	v->ptr = start + (offset % bytes_per_block);
+	v->len = len;
 	return 0;
 }
+
+/**
+ * View as much of a file from offset on as is contiguous in the image. For
+ * a single image that's the rest of the file, for a volume set it's up to
+ * the end of the stripe. The view is empty at the end of the file.
+ */
+int view_file_chunk(filesystem *fs, index_entry *entry, long long offset, view *v)
+{
+	uint32_t bytes_per_block = 1 << (fs->s_block->block_size + 7);
+	long long len, run;
+
+	if (entry->type != FILE_ENTRY || offset < 0 || offset > entry->file.length) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	len = entry->file.length - offset;
+	if (len > 0 && get_data_block(fs, entry->file.starting_block + (offset / bytes_per_block), &run) != NULL &&
+			len > run * bytes_per_block - (offset % bytes_per_block)) {
+		len = run * bytes_per_block - (offset % bytes_per_block);
+	}
+
+	return view_file_range(fs, entry, offset, len, v);
+}
+
+int view_file(filesystem *fs, index_entry *entry, view *v)
+{
+	return view_file_range(fs, entry, 0, entry->file.length, v);
+}
+
+/**
+ * Pass an access pattern hint for a view on to the kernel. The view is
+ * widened to whole pages, since that's all madvise works with.
+ */
+int advise_view(const view *v, int advice)
+{
+	uintptr_t page_size = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)v->ptr & ~(page_size - 1);
+	uintptr_t end = (uintptr_t)v->ptr + v->len;
+	int hint;
+
+	switch (advice) {
+		case ADVISE_NORMAL:
+			hint = MADV_NORMAL;
+			break;
+		case ADVISE_SEQUENTIAL:
+			hint = MADV_SEQUENTIAL;
+			break;
+		case ADVISE_RANDOM:
+			hint = MADV_RANDOM;
+			break;
+		case ADVISE_WILLNEED:
+			hint = MADV_WILLNEED;
+			break;
+		case ADVISE_HUGEPAGE:
+#ifdef MADV_HUGEPAGE
+			hint = MADV_HUGEPAGE;
+			break;
+#else
+			errno = ENOTSUP;
+			return -1;
+#endif
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+
+	if (v->len == 0) {
+		return 0;
+	}
+
+	return madvise((void*)start, end - start, hint);
+}
@@ -0,0 +1,159 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+
+#include "delta.h"
+
+/*
+ * sfs-patch applies a patch from sfs-delta to an image in place. Runs are
+ * written in ascending block order, in chunks of up to PATCH_CHUNK bytes,
+ * so the device sees large sequential writes. The image is checked against
+ * the patch before anything is written, and again once it's done.
+ */
+
+#define PATCH_CHUNK     (1 << 20)
+
+static int check_image(char *fname, uint32_t block_bytes, long long total_blocks, uint64_t id)
+{
+    filesystem *fs = open_filesystem_readonly(fname);
+    int ok;
+
+    if (fs == NULL) {
+        return 0;
+    }
+
+    ok = fs->s_block->block_size < 25 && (1u << (fs->s_block->block_size + 7)) == block_bytes &&
+        fs->s_block->total_blocks == total_blocks && image_id(fs) == id;
+    close_filesystem(fs);
+
+    return ok;
+}
+
+static int apply_runs(FILE *in, int fd, uint32_t bytes_per_block, long long total_blocks)
+{
+    char *buf = malloc(PATCH_CHUNK);
+    long long chunk_blocks = PATCH_CHUNK / bytes_per_block;
+    delta_run run;
+
+    if (buf == NULL) {
+        perror("Allocating patch buffer");
+        return -1;
+    }
+
+    while (fread(&run, sizeof(run), 1, in) == 1 && run.count > 0) {
+        if (run.block < 0 || run.block + run.count > total_blocks) {
+            printf("Patch run %lld+%lld is outside the image\n", run.block, run.count);
+            free(buf);
+            return -1;
+        }
+
+        for (long long done = 0; done < run.count; ) {
+            long long blocks = run.count - done < chunk_blocks ? run.count - done : chunk_blocks;
+            size_t bytes = blocks * bytes_per_block;
+            off_t offset = (run.block + done) * bytes_per_block;
+
+            if (fread(buf, 1, bytes, in) != bytes) {
+                printf("Patch is truncated\n");
+                free(buf);
+                return -1;
+            }
+
+            if (pwrite(fd, buf, bytes, offset) != (ssize_t)bytes) {
+                perror("Writing image");
+                free(buf);
+                return -1;
+            }
+            done += blocks;
+        }
+    }
+
+    free(buf);
+    if (ferror(in) || feof(in)) {
+        printf("Patch is truncated\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    delta_header header;
+    FILE *in;
+    int fd;
+
+    if (argc != 3) {
+        printf("Usage: %s <image> <patch|->\n", argv[0]);
+        exit(1);
+    }
+
+    if (strcmp(argv[2], "-") == 0) {
+        in = stdin;
+    } else {
+        in = fopen(argv[2], "rb");
+        if (in == NULL) {
+            perror("Opening patch");
+            exit(1);
+        }
+    }
+
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+            memcmp(header.magic, DELTA_MAGIC, sizeof(header.magic)) != 0) {
+        printf("Not an SFS patch\n");
+        exit(1);
+    }
+
+    // SFS blocks are a power of two from 128 bytes, and runs are copied in
+    // chunks of whole blocks.
+    if (header.block_bytes < 128 || header.block_bytes > PATCH_CHUNK ||
+            (header.block_bytes & (header.block_bytes - 1)) != 0) {
+        printf("Patch has an invalid block size of %u bytes\n", header.block_bytes);
+        exit(1);
+    }
+
+    if (!check_image(argv[1], header.block_bytes, header.base_total_blocks, header.base_id)) {
+        printf("%s is not the image this patch was made against\n", argv[1]);
+        exit(1);
+    }
+
+    fd = open(argv[1], O_RDWR);
+    if (fd < 0) {
+        perror("File open");
+        exit(1);
+    }
+
+    if (header.target_total_blocks > header.base_total_blocks &&
+            ftruncate(fd, header.target_total_blocks * header.block_bytes) < 0) {
+        perror("Growing image");
+        exit(1);
+    }
+
+    if (apply_runs(in, fd, header.block_bytes, header.target_total_blocks) < 0) {
+        printf("Patch failed, %s is only partly updated\n", argv[1]);
+        exit(1);
+    }
+
+    if (header.target_total_blocks < header.base_total_blocks &&
+            ftruncate(fd, header.target_total_blocks * header.block_bytes) < 0) {
+        perror("Shrinking image");
+        exit(1);
+    }
+
+    if (fsync(fd) < 0) {
+        perror("Syncing image");
+        exit(1);
+    }
+    close(fd);
+
+    if (!check_image(argv[1], header.block_bytes, header.target_total_blocks, header.target_id)) {
+        printf("Patched image doesn't match the target\n");
+        exit(1);
+    }
+
+    return 0;
+}
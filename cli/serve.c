@@ -0,0 +1,736 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+
+#include "common.h"
+
+/*
+ * sfs-serve answers HTTP GET, HEAD and single Range requests for the files
+ * in an image, or a volume set, without mounting it. The index is read
+ * once into a name table, so a request costs a hash lookup and no
+ * filesystem metadata work. Each worker thread runs its own epoll loop on
+ * its own SO_REUSEPORT listener, and response bodies go out with sendfile
+ * straight from the image, so file data is never copied through userspace.
+ * Connections that make no progress for the idle timeout are closed.
+ */
+
+#define DEFAULT_PORT    8080
+#define REQUEST_MAX     8192
+#define HEADER_MAX      1024
+#define MAX_EVENTS      256
+#define IDLE_TIMEOUT    30      // Seconds
+
+typedef struct name_table {
+    struct index_entry **slots;
+    uint32_t mask;
+} name_table;
+
+typedef struct server {
+    filesystem *fs;
+    name_table names;
+    uint32_t bytes_per_block;
+    int port;
+    int idle_timeout;
+} server;
+
+typedef struct conn {
+    int fd;
+    int keep_alive;
+    int responding;
+    char in[REQUEST_MAX];
+    size_t in_len;
+    char out[HEADER_MAX];
+    size_t out_len;
+    size_t out_sent;
+    struct index_entry *body;   // File still being sent, or NULL
+    long long body_pos;         // Bytes [body_pos, body_end) of it are left
+    long long body_end;
+    time_t last_active;
+    struct conn *prev;          // Neighbours in the idle list
+    struct conn *next;
+} conn;
+
+/**
+ * A worker's connections, least recently active first, so idle ones are
+ * found at the front without walking the rest.
+ */
+typedef struct conn_list {
+    conn *oldest;
+    conn *newest;
+} conn_list;
+
+/**
+ * Files only, keyed by name. The index is walked newest entry first and the
+ * first entry with a name wins, the same as an index scan would.
+ */
+static int name_table_init(name_table *t, filesystem *fs)
+{
+    long long entries = fs->s_block->index_bytes / INDEX_ENTRY_SIZE;
+    struct index_entry *entry = (struct index_entry*)fs->index_region;
+    uint32_t size = 16;
+
+    while (size < entries * 2) {
+        size <<= 1;
+    }
+
+    t->slots = calloc(size, sizeof(struct index_entry*));
+    if (t->slots == NULL) {
+        perror("Allocating name table");
+        return -1;
+    }
+    t->mask = size - 1;
+
+    for (long long i = 0; i < entries; i++, entry++) {
+        if (entry->type != FILE_ENTRY) {
+            continue;
+        }
+
+        uint32_t slot = sfs_name_hash(entry->file.file_name) & t->mask;
+        while (t->slots[slot] != NULL &&
+                strcmp(t->slots[slot]->file.file_name, entry->file.file_name) != 0) {
+            slot = (slot + 1) & t->mask;
+        }
+        if (t->slots[slot] == NULL) {
+            t->slots[slot] = entry;
+        }
+    }
+
+    return 0;
+}
+
+static struct index_entry *name_table_find(name_table *t, const char *name)
+{
+    uint32_t slot = sfs_name_hash(name) & t->mask;
+
+    for (; t->slots[slot] != NULL; slot = (slot + 1) & t->mask) {
+        if (strcmp(t->slots[slot]->file.file_name, name) == 0) {
+            return t->slots[slot];
+        }
+    }
+
+    return NULL;
+}
+
+static const char *content_type(const char *name)
+{
+    static const char *types[][2] = {
+        { ".html", "text/html; charset=utf-8" },
+        { ".htm", "text/html; charset=utf-8" },
+        { ".css", "text/css" },
+        { ".js", "text/javascript" },
+        { ".json", "application/json" },
+        { ".txt", "text/plain; charset=utf-8" },
+        { ".svg", "image/svg+xml" },
+        { ".png", "image/png" },
+        { ".jpg", "image/jpeg" },
+        { ".jpeg", "image/jpeg" },
+        { ".gif", "image/gif" },
+        { ".webp", "image/webp" },
+        { ".ico", "image/x-icon" },
+        { ".wasm", "application/wasm" },
+        { ".woff2", "font/woff2" },
+    };
+    const char *ext = strrchr(name, '.');
+
+    if (ext != NULL) {
+        for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+            if (strcasecmp(ext, types[i][0]) == 0) {
+                return types[i][1];
+            }
+        }
+    }
+
+    return "application/octet-stream";
+}
+
+/**
+ * Decode a request path into an SFS name, dropping the leading "/" and any
+ * query string. Returns -1 if it doesn't decode or can't be a file name.
+ */
+static int decode_path(const char *path, size_t len, char *name, size_t name_len)
+{
+    size_t n = 0;
+
+    while (len > 0 && *path == '/') {
+        path++;
+        len--;
+    }
+
+    for (size_t i = 0; i < len && path[i] != '?' && path[i] != '#'; i++) {
+        char c = path[i];
+
+        if (c == '%') {
+            unsigned int byte;
+            if (i + 2 >= len || sscanf(path + i + 1, "%2x", &byte) != 1 || byte == 0) {
+                return -1;
+            }
+            c = byte;
+            i += 2;
+        }
+        if (n + 1 >= name_len) {
+            return -1;
+        }
+        name[n++] = c;
+    }
+
+    name[n] = '\0';
+    return n > 0 ? 0 : -1;
+}
+
+/**
+ * Parse a Range header value against a file of length bytes. Returns 1 and
+ * sets [start, end) for a single satisfiable range, 0 if the header should
+ * be ignored and the whole file sent, or -1 if it can't be satisfied.
+ */
+static int parse_range(const char *value, long long length, long long *start, long long *end)
+{
+    char *p;
+    long long first, last;
+
+    if (strncasecmp(value, "bytes=", 6) != 0 || strchr(value, ',') != NULL) {
+        return 0;
+    }
+    value += 6;
+
+    if (*value == '-') {
+        last = strtoll(value + 1, &p, 10);
+        if (p == value + 1 || last < 0) {
+            return 0;
+        }
+        if (last == 0 || length == 0) {
+            return -1;
+        }
+        *start = last < length ? length - last : 0;
+        *end = length;
+        return 1;
+    }
+
+    first = strtoll(value, &p, 10);
+    if (p == value || *p != '-' || first < 0) {
+        return 0;
+    }
+    value = p + 1;
+    if (*value == '\0' || *value == '\r' || *value == ' ') {
+        last = length - 1;
+    } else {
+        last = strtoll(value, &p, 10);
+        if (p == value || last < first) {
+            return 0;
+        }
+    }
+
+    if (first >= length) {
+        return -1;
+    }
+    *start = first;
+    *end = (last < length ? last : length - 1) + 1;
+    return 1;
+}
+
+static void respond_error(conn *c, int status, const char *reason, long long length)
+{
+    c->out_len = snprintf(c->out, sizeof(c->out),
+            "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n", status, reason);
+    if (status == 405) {
+        c->out_len += snprintf(c->out + c->out_len, sizeof(c->out) - c->out_len,
+                "Allow: GET, HEAD\r\n");
+    }
+    if (status == 416) {
+        c->out_len += snprintf(c->out + c->out_len, sizeof(c->out) - c->out_len,
+                "Content-Range: bytes */%lld\r\n", length);
+    }
+    c->out_len += snprintf(c->out + c->out_len, sizeof(c->out) - c->out_len, "%s\r\n",
+            c->keep_alive ? "" : "Connection: close\r\n");
+    c->body = NULL;
+}
+
+/**
+ * Find a header's value in a request, or NULL. The value runs to the end
+ * of its line.
+ */
+static const char *find_header(const char *headers, const char *name)
+{
+    size_t len = strlen(name);
+    const char *line = strstr(headers, "\r\n");
+
+    while (line != NULL && line[2] != '\r') {
+        line += 2;
+        if (strncasecmp(line, name, len) == 0 && line[len] == ':') {
+            line += len + 1;
+            while (*line == ' ' || *line == '\t') {
+                line++;
+            }
+            return line;
+        }
+        line = strstr(line, "\r\n");
+    }
+
+    return NULL;
+}
+
+static int header_has(const char *value, const char *token)
+{
+    size_t len = strlen(token);
+
+    for (; value != NULL && *value != '\r'; value++) {
+        if (strncasecmp(value, token, len) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Build the response to the request at the start of c->in. The request
+ * has been NUL terminated after its last header line.
+ */
+static void build_response(server *srv, conn *c)
+{
+    char name[sizeof(((struct file_entry*)0)->file_name)];
+    const char *method = c->in, *path, *version, *value;
+    struct index_entry *entry;
+    long long start = 0, end, length;
+    int head, ranged = 0, status = 200;
+    char modified[64];
+    struct tm tm;
+    time_t when;
+
+    path = strchr(method, ' ');
+    version = path != NULL ? strchr(path + 1, ' ') : NULL;
+    if (path == NULL || version == NULL) {
+        c->keep_alive = 0;
+        respond_error(c, 400, "Bad Request", 0);
+        return;
+    }
+
+    // HTTP/1.1 keeps the connection by default, 1.0 only if asked
+    value = find_header(c->in, "Connection");
+    if (strncmp(version + 1, "HTTP/1.1", 8) == 0) {
+        c->keep_alive = !header_has(value, "close");
+    } else {
+        c->keep_alive = header_has(value, "keep-alive");
+    }
+
+    // Request bodies are never read, so whatever follows one on the
+    // connection can't be parsed. Answer and close instead.
+    value = find_header(c->in, "Content-Length");
+    if ((value != NULL && atoll(value) > 0) || find_header(c->in, "Transfer-Encoding") != NULL) {
+        c->keep_alive = 0;
+    }
+
+    head = strncmp(method, "HEAD ", 5) == 0;
+    if (!head && strncmp(method, "GET ", 4) != 0) {
+        respond_error(c, 405, "Method Not Allowed", 0);
+        return;
+    }
+
+    if (decode_path(path + 1, version - path - 1, name, sizeof(name)) < 0 ||
+            (entry = name_table_find(&srv->names, name)) == NULL) {
+        respond_error(c, 404, "Not Found", 0);
+        return;
+    }
+
+    length = entry->file.length;
+    end = length;
+    value = find_header(c->in, "Range");
+    if (value != NULL) {
+        ranged = parse_range(value, length, &start, &end);
+        if (ranged < 0) {
+            respond_error(c, 416, "Range Not Satisfiable", length);
+            return;
+        }
+        status = ranged ? 206 : 200;
+    }
+
+    when = entry->file.timestamp / 1000;
+    gmtime_r(&when, &tm);
+    strftime(modified, sizeof(modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    c->out_len = snprintf(c->out, sizeof(c->out),
+            "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %lld\r\n"
+            "Accept-Ranges: bytes\r\nLast-Modified: %s\r\n",
+            status, status == 206 ? "Partial Content" : "OK", content_type(name),
+            end - start, modified);
+    if (ranged) {
+        c->out_len += snprintf(c->out + c->out_len, sizeof(c->out) - c->out_len,
+                "Content-Range: bytes %lld-%lld/%lld\r\n", start, end - 1, length);
+    }
+    c->out_len += snprintf(c->out + c->out_len, sizeof(c->out) - c->out_len, "%s\r\n",
+            c->keep_alive ? "" : "Connection: close\r\n");
+
+    c->body = head || end == start ? NULL : entry;
+    c->body_pos = start;
+    c->body_end = end;
+}
+
+/**
+ * Send as much of the response as the socket takes. Returns 1 once it's
+ * all gone, 0 if the socket is full, or -1 if the connection failed.
+ */
+static int send_response(server *srv, conn *c)
+{
+    ssize_t n;
+
+    while (c->out_sent < c->out_len) {
+        n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent,
+                MSG_NOSIGNAL | (c->body != NULL ? MSG_MORE : 0));
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : (errno == EINTR ? 0 : -1);
+        }
+        c->out_sent += n;
+    }
+
+    while (c->body != NULL && c->body_pos < c->body_end) {
+        long long block = c->body->file.starting_block + (c->body_pos / srv->bytes_per_block);
+        long long within = c->body_pos % srv->bytes_per_block;
+        long long offset, run, count;
+        off_t off;
+        int fd;
+
+        // A volume set sends each stripe from the image that holds it
+        fd = get_data_location(srv->fs, block, &offset, &run);
+        if (fd < 0) {
+            return -1;
+        }
+        count = run * srv->bytes_per_block - within;
+        if (count > c->body_end - c->body_pos) {
+            count = c->body_end - c->body_pos;
+        }
+
+        off = offset + within;
+        n = sendfile(c->fd, fd, &off, count);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        c->body_pos += n;
+    }
+
+    return 1;
+}
+
+static time_t now_seconds(void)
+{
+    struct timespec spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+
+    return spec.tv_sec;
+}
+
+static void list_remove(conn_list *list, conn *c)
+{
+    if (c->prev != NULL) {
+        c->prev->next = c->next;
+    } else {
+        list->oldest = c->next;
+    }
+    if (c->next != NULL) {
+        c->next->prev = c->prev;
+    } else {
+        list->newest = c->prev;
+    }
+    c->prev = c->next = NULL;
+}
+
+/**
+ * Mark a connection as active now, moving it to the back of the list.
+ */
+static void list_touch(conn_list *list, conn *c, time_t now)
+{
+    if (list->newest != c) {
+        if (c->prev != NULL || list->oldest == c) {
+            list_remove(list, c);
+        }
+        c->prev = list->newest;
+        if (list->newest != NULL) {
+            list->newest->next = c;
+        } else {
+            list->oldest = c;
+        }
+        list->newest = c;
+    }
+    c->last_active = now;
+}
+
+static void close_conn(int epfd, conn_list *list, conn *c)
+{
+    list_remove(list, c);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c);
+}
+
+/**
+ * Close every connection that has been idle for the timeout. Slow readers
+ * count as idle too once sendfile stops making progress.
+ */
+static void close_idle(int epfd, conn_list *list, time_t now, int timeout)
+{
+    while (list->oldest != NULL && now - list->oldest->last_active >= timeout) {
+        close_conn(epfd, list, list->oldest);
+    }
+}
+
+/**
+ * Read what's waiting and answer every complete request, pipelined ones
+ * included. Returns -1 once the connection should be closed.
+ */
+static int handle_conn(server *srv, int epfd, conn *c, uint32_t events)
+{
+    struct epoll_event ev;
+    ssize_t n;
+    char *end;
+    int sent;
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        return -1;
+    }
+
+    if (!c->responding) {
+        n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len, 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            return -1;
+        }
+        if (n > 0) {
+            c->in_len += n;
+        }
+    }
+
+    for (;;) {
+        if (!c->responding) {
+            c->in[c->in_len] = '\0';
+            end = strstr(c->in, "\r\n\r\n");
+            if (end == NULL) {
+                if (c->in_len == sizeof(c->in) - 1) {
+                    c->keep_alive = 0;
+                    respond_error(c, 431, "Request Header Fields Too Large", 0);
+                    c->in_len = 0;
+                } else {
+                    break;
+                }
+            } else {
+                size_t len = end + 4 - c->in;
+
+                end[2] = '\0';
+                build_response(srv, c);
+                memmove(c->in, c->in + len, c->in_len - len);
+                c->in_len -= len;
+            }
+            c->responding = 1;
+            c->out_sent = 0;
+        }
+
+        sent = send_response(srv, c);
+        if (sent < 0) {
+            return -1;
+        }
+        if (sent == 0) {
+            ev.events = EPOLLOUT;
+            ev.data.ptr = c;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+            return 0;
+        }
+
+        c->responding = 0;
+        if (!c->keep_alive) {
+            return -1;
+        }
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    return 0;
+}
+
+/**
+ * Listen on every address, IPv6 and IPv4 alike where the kernel has IPv6,
+ * and IPv4 only where it doesn't.
+ */
+static int open_listener(int port)
+{
+    struct sockaddr_in6 addr6;
+    struct sockaddr_in addr4;
+    struct sockaddr *addr = (struct sockaddr*)&addr6;
+    socklen_t addr_len = sizeof(addr6);
+    int one = 1;
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    memset(&addr6, 0, sizeof(addr6));
+    addr6.sin6_family = AF_INET6;
+    addr6.sin6_addr = in6addr_any;
+    addr6.sin6_port = htons(port);
+    if (fd < 0) {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) {
+            return -1;
+        }
+
+        memset(&addr4, 0, sizeof(addr4));
+        addr4.sin_family = AF_INET;
+        addr4.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr4.sin_port = htons(port);
+        addr = (struct sockaddr*)&addr4;
+        addr_len = sizeof(addr4);
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    if (bind(fd, addr, addr_len) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void *serve_loop(void *arg)
+{
+    server *srv = arg;
+    struct epoll_event ev, events[MAX_EVENTS];
+    conn_list list = { NULL, NULL };
+    int listener, epfd, n, fd, one = 1;
+    time_t now;
+
+    listener = open_listener(srv->port);
+    epfd = epoll_create1(0);
+    if (listener < 0 || epfd < 0) {
+        perror("Listening");
+        exit(1);
+    }
+
+    // The listener is the one event without a connection
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &ev);
+
+    for (;;) {
+        // Wake at least once a second to close idle connections
+        n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+        now = now_seconds();
+        for (int i = 0; i < n; i++) {
+            conn *c = events[i].data.ptr;
+
+            if (c != NULL) {
+                if (handle_conn(srv, epfd, c, events[i].events) < 0) {
+                    close_conn(epfd, &list, c);
+                } else {
+                    list_touch(&list, c, now);
+                }
+                continue;
+            }
+
+            while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                c = calloc(1, sizeof(conn));
+                if (c == NULL) {
+                    close(fd);
+                    continue;
+                }
+                c->fd = fd;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                ev.events = EPOLLIN;
+                ev.data.ptr = c;
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                    close(fd);
+                    free(c);
+                    continue;
+                }
+                list_touch(&list, c, now);
+            }
+        }
+        close_idle(epfd, &list, now, srv->idle_timeout);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    server srv;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t *workers;
+    int c;
+
+    memset(&srv, 0, sizeof(srv));
+    srv.port = DEFAULT_PORT;
+    srv.idle_timeout = IDLE_TIMEOUT;
+
+    while ((c = getopt(argc, argv, "p:t:i:")) != -1) {
+        switch (c) {
+            case 'p':
+                srv.port = atoi(optarg);
+                break;
+            case 't':
+                threads = atol(optarg);
+                break;
+            case 'i':
+                srv.idle_timeout = atoi(optarg);
+                break;
+            default:
+                printf("Usage: %s [-p port] [-t threads] [-i idle seconds] <image[,image...]>\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    if (optind != argc - 1) {
+        printf("Usage: %s [-p port] [-t threads] [-i idle seconds] <image[,image...]>\n", argv[0]);
+        exit(1);
+    }
+
+    srv.fs = open_filesystem_readonly(argv[optind]);
+    if (srv.fs == NULL || name_table_init(&srv.names, srv.fs) < 0) {
+        exit(1);
+    }
+    srv.bytes_per_block = 1 << (srv.fs->s_block->block_size + 7);
+
+    // A client going away mid sendfile must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (srv.idle_timeout < 1) {
+        srv.idle_timeout = 1;
+    }
+    workers = calloc(threads, sizeof(pthread_t));
+    if (workers == NULL) {
+        perror("Starting workers");
+        exit(1);
+    }
+
+    printf("Serving %s on port %d with %ld threads\n", argv[optind], srv.port, threads);
+    fflush(stdout);
+
+    for (long i = 1; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, serve_loop, &srv) != 0) {
+            perror("Starting workers");
+            exit(1);
+        }
+    }
+    serve_loop(&srv);
+
+    return 0;
+}
@@ -9,48 +9,186 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <stddef.h>
+#include <fnmatch.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SCANNERS 1
+#endif
 
 #include "../common/sfs.h"
 #include "common.h"
 
-filesystem *open_filesystem(char *fname)
+static filesystem *map_image(int fd, superblock *s, int prot, int flags);
+static filesystem *open_volume_set(char *fnames, int read_only);
+
+static filesystem *open_image(char *fname, int read_only)
 {
+    // A comma separated list names the images of a volume set
+    if (strchr(fname, ',') != NULL) {
+        return open_volume_set(fname, read_only);
+    }
+
     // We need to read in the superblock to get
     // enough information to map the file.
     char *buf = malloc(SUPERBLOCK_OFFSET + sizeof(superblock));
 
-    int fd = open(fname, O_RDWR, S_IRUSR | S_IWUSR);
+    int fd = open(fname, read_only ? O_RDONLY : O_RDWR, S_IRUSR | S_IWUSR);
     if (fd < 0) {
         perror("File open");
+        free(buf);
         return NULL;
     }
 
     if (read(fd, buf, SUPERBLOCK_OFFSET + sizeof(superblock))<0) {
         perror("Reading file");
+        free(buf);
+        close(fd);
         return NULL;
     }
 
     // Point to the superblock, and grab the mapped filesystem
     superblock *s = (superblock*)(buf + SUPERBLOCK_OFFSET);
-    filesystem *fs = map_filesystem(fd, s);
-    if (fs==NULL) {
-        return NULL;
+    filesystem *fs;
+    if (read_only) {
+        fs = map_image(fd, s, PROT_READ, MAP_PRIVATE);
+    } else {
+        fs = map_image(fd, s, PROT_READ | PROT_WRITE, MAP_SHARED);
     }
 
-    fs->fd = fd;
-
     // Cleanup. We will read the superblock from the map
     // from now on.
     free(buf);
+    if (fs==NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    if (fs->s_block->features & SFS_FEATURE_VOLUME_SET) {
+        struct index_entry *volume_id = (struct index_entry*)(fs->index_region + fs->s_block->index_bytes - INDEX_ENTRY_SIZE);
+        fprintf(stderr, "%s is image %d of a volume set of %d, open them together as a,b,...\n",
+                fname, volume_id->volume_id.set_member, volume_id->volume_id.set_members);
+        close_filesystem(fs);
+        return NULL;
+    }
     return fs;
 }
 
-filesystem *create_filesystem(int fd, superblock *s) 
+/**
+ * Open every image of a volume set, named in a comma separated list. The
+ * images may be listed in any order, but they must all be there and all
+ * carry the same set description. Returns member 0, which holds the index.
+ */
+static filesystem *open_volume_set(char *fnames, int read_only)
+{
+    char *names = strdup(fnames);
+    char *name, *save = NULL;
+    filesystem **members = NULL;
+    filesystem *fs;
+    volume_id_entry *first = NULL, *id;
+    int count = 1;
+
+    for (char *p = fnames; *p; p++) {
+        count += (*p == ',');
+    }
+    if (names == NULL || count > 255 || (members = calloc(count, sizeof(filesystem*))) == NULL) {
+        fprintf(stderr, "Too many images in the volume set\n");
+        free(names);
+        return NULL;
+    }
+
+    for (name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        int fd = open(name, read_only ? O_RDONLY : O_RDWR);
+        superblock s;
+
+        if (fd < 0 || pread(fd, &s, sizeof(superblock), SUPERBLOCK_OFFSET) != sizeof(superblock)) {
+            perror(name);
+            if (fd >= 0) {
+                close(fd);
+            }
+            goto fail;
+        }
+
+        fs = read_only ? map_image(fd, &s, PROT_READ, MAP_PRIVATE) :
+                map_image(fd, &s, PROT_READ | PROT_WRITE, MAP_SHARED);
+        if (fs == NULL) {
+            close(fd);
+            goto fail;
+        }
+
+        id = &((struct index_entry*)(fs->index_region + s.index_bytes - INDEX_ENTRY_SIZE))->volume_id;
+        if (!(s.features & SFS_FEATURE_VOLUME_SET) || id->set_members != count ||
+                id->set_member >= count || members[id->set_member] != NULL ||
+                (first != NULL && (id->timestamp != first->timestamp ||
+                        id->stripe_shift != first->stripe_shift))) {
+            fprintf(stderr, "%s doesn't belong with the other images of the set\n", name);
+            close_filesystem(fs);
+            goto fail;
+        }
+        if (first == NULL) {
+            first = id;
+        }
+        members[id->set_member] = fs;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (members[i] == NULL) {
+            fprintf(stderr, "Volume set is missing image %d\n", i);
+            goto fail;
+        }
+        members[i]->set_members = count;
+        members[i]->stripe_shift = first->stripe_shift;
+    }
+
+    free(names);
+    members[0]->members = members;
+    return members[0];
+
+fail:
+    for (int i = 0; i < count; i++) {
+        if (members[i] != NULL) {
+            close_filesystem(members[i]);
+        }
+    }
+    free(members);
+    free(names);
+    return NULL;
+}
+
+filesystem *open_filesystem(char *fname)
+{
+    return open_image(fname, 0);
+}
+
+/**
+ * Open an image without write access. The map is private, so nothing done
+ * through it can reach the file, and views into it are safe to hand out.
+ */
+filesystem *open_filesystem_readonly(char *fname)
+{
+    return open_image(fname, 1);
+}
+
+/**
+ * Lay out an empty image in fd: the reserved blocks, the starting marker
+ * and a Volume ID entry.
+ */
+static filesystem *create_image(int fd, superblock *s)
 {
     long long media_size = get_media_size(s);
 
-    // Meet the SFS spec
+    // Meet the SFS spec. The first reserved block holds the superblock,
+    // any optional tables follow it.
     s->reserved_blocks = 1;
+    if (s->features & SFS_FEATURE_NAME_HASH) {
+        s->hash_block = s->reserved_blocks;
+        s->reserved_blocks += get_name_hash_blocks(s);
+    }
+    if (s->features & SFS_FEATURE_CHECKSUMS) {
+        s->csum_block = s->reserved_blocks;
+        s->reserved_blocks += get_checksum_blocks(s);
+    }
     strcpy(s->magic, "\x53\x46\x53\x10");
     s->checksum = superblock_calc_checksum(s);
     s->index_bytes = sizeof(struct index_entry);    // Room for one entry
@@ -80,6 +218,16 @@ filesystem *create_filesystem(int fd, superblock *s)
     volume_id->volume_id.timestamp = get_milliseconds();
     strcpy(volume_id->volume_id.volume_name, "The Header");
 
+    return fs;
+}
+
+filesystem *create_filesystem(int fd, superblock *s) 
+{
+    filesystem *fs = create_image(fd, s);
+    if (fs == NULL) {
+        return NULL;
+    }
+
     // Create a directory entry
     struct index_entry *first_dir = add_index_entry(fs, DIRECTORY_ENTRY);
     strcpy(first_dir->dir.dir_name, "first_directory");
@@ -114,6 +262,11 @@ filesystem *create_filesystem(int fd, superblock *s)
 
     memcpy(fs->data_region + 512, "This is the second file\n", 24);
 
+    // Files added after the defaults are allocated from the starting
+    // marker, which sits at the bottom of the index.
+    struct index_entry *marker = (struct index_entry*)fs->index_region;
+    marker->first_entry.next_starting_block = 2;
+
     // Push the index region beyond a single block (more than 512 bytes
     // worth of entries).
     struct index_entry *dir = add_index_entry(fs, DIRECTORY_ENTRY);
@@ -148,7 +301,7 @@ struct index_entry *add_index_entry(filesystem *fs, int type)
     return new_entry;
 }
 
-filesystem *map_filesystem(int fd, superblock *s)
+static filesystem *map_image(int fd, superblock *s, int prot, int flags)
 {
     uint32_t bytes_per_block = 1 << (s->block_size + 7);
     long long media_size = get_media_size(s);
@@ -159,13 +312,14 @@ filesystem *map_filesystem(int fd, superblock *s)
         return NULL;
     }
  
-    char *map = mmap(NULL, media_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    char *map = mmap(NULL, media_size, prot, flags, fd, 0);
     if (map == MAP_FAILED) {
         free(fs);
         perror("Error mmapping the file");
         return NULL;
     }
     
+    fs->fd = fd;
     fs->map = map;
     fs->s_block = (superblock*)(map + SUPERBLOCK_OFFSET);
     fs->data_region = map + (s->reserved_blocks * bytes_per_block);
@@ -174,8 +328,526 @@ filesystem *map_filesystem(int fd, superblock *s)
     return fs;
 }
 
+filesystem *map_filesystem(int fd, superblock *s)
+{
+    return map_image(fd, s, PROT_READ | PROT_WRITE, MAP_SHARED);
+}
+
+/**
+ * Fill the name hash table in the reserved blocks from the current index.
+ * This should be called once all entries have been added, since the module
+ * ignores a table that was built against a different index size.
+ */
+int build_name_hash(filesystem *fs)
+{
+    superblock *s = fs->s_block;
+    uint32_t bytes_per_block = 1 << (s->block_size + 7);
+    long long media_size = get_media_size(s);
+    long long entries = s->index_bytes / INDEX_ENTRY_SIZE;
+    name_hash_slot *table = (name_hash_slot*)(fs->map + (s->hash_block * bytes_per_block));
+    uint32_t mask = s->hash_slots - 1;
+
+    if (!(s->features & SFS_FEATURE_NAME_HASH)) {
+        return 0;
+    }
+
+    // Keep the load factor at or below one half so probe runs stay short.
+    if (entries * 2 > s->hash_slots) {
+        fprintf(stderr, "Name hash has %u slots, too few for %lld entries\n",
+                s->hash_slots, entries);
+        s->features &= ~SFS_FEATURE_NAME_HASH;
+        return -1;
+    }
+
+    memset(table, 0, s->hash_slots * sizeof(name_hash_slot));
+
+    // Insert from the lowest entry up, the same order the index is scanned
+    // in, so duplicate names resolve to the same entry either way.
+    for (long long pos = entries; pos > 0; pos--) {
+        struct index_entry *entry = (struct index_entry*)(fs->map + (media_size - (pos * INDEX_ENTRY_SIZE)));
+        char *name = sfs_entry_name(entry);
+        uint32_t hash, slot;
+
+        if (name == NULL) {
+            continue;
+        }
+
+        hash = sfs_name_hash(name);
+        for (slot = hash & mask; table[slot].entry != 0; slot = (slot + 1) & mask)
+            ;
+
+        table[slot].hash = hash;
+        table[slot].entry = pos;
+    }
+
+    s->hash_index_bytes = s->index_bytes;
+    return 0;
+}
+
+/**
+ * Fill the checksum table in the reserved blocks with the CRC32C of every
+ * block in the data area. Like the name hash, this has to run once all the
+ * data has been written. Each image of a volume set covers its own blocks.
+ */
+int build_checksums(filesystem *fs)
+{
+    superblock *s = fs->s_block;
+
+    if (fs->members != NULL) {
+        for (int i = 1; i < fs->set_members; i++) {
+            build_checksums(fs->members[i]);
+        }
+    }
+
+    uint32_t bytes_per_block = 1 << (s->block_size + 7);
+    uint32_t *table = (uint32_t*)(fs->map + (s->csum_block * bytes_per_block));
+    long long blocks = s->data_blocks;
+
+    if (!(s->features & SFS_FEATURE_CHECKSUMS)) {
+        return 0;
+    }
+
+    // Never checksum past the start of the index
+    if (fs->data_region + (blocks * bytes_per_block) > fs->index_region) {
+        blocks = (fs->index_region - fs->data_region) / bytes_per_block;
+    }
+
+    memset(table, 0, get_checksum_blocks(s) * bytes_per_block);
+    for (long long b = 0; b < blocks; b++) {
+        table[b] = crc32c(~0U, fs->data_region + (b * bytes_per_block), bytes_per_block);
+    }
+
+    return 0;
+}
+
+/**
+ * Create a volume set across count images, striping stripe_shift sized
+ * runs of s->data_blocks round robin. Member 0 gets the default entries
+ * and the index; the others only hold data. Returns member 0.
+ */
+filesystem *create_volume_set(int *fds, int count, superblock *s, long long index_blocks, int stripe_shift)
+{
+    long long stripes = (s->data_blocks + (1LL << stripe_shift) - 1) >> stripe_shift;
+    long long member_blocks = ((stripes + count - 1) / count) << stripe_shift;
+    filesystem **members = calloc(count, sizeof(filesystem*));
+    struct index_entry *volume_id;
+    long long timestamp = 0;
+
+    if (members == NULL || count < 2 || count > 255) {
+        free(members);
+        return NULL;
+    }
+
+    for (int i = 0; i < count; i++) {
+        superblock ms = *s;
+
+        ms.features |= SFS_FEATURE_VOLUME_SET;
+        ms.data_blocks = member_blocks;
+        if (i > 0) {
+            // The index and its hash table only live in member 0
+            ms.features &= ~SFS_FEATURE_NAME_HASH;
+            ms.hash_slots = 0;
+        }
+        ms.total_blocks = 1 + get_name_hash_blocks(&ms) + get_checksum_blocks(&ms) +
+                member_blocks + (i == 0 ? index_blocks : 1) + 1;
+
+        members[i] = i == 0 ? create_filesystem(fds[i], &ms) : create_image(fds[i], &ms);
+        if (members[i] == NULL) {
+            for (int j = 0; j < i; j++) {
+                close_filesystem(members[j]);
+            }
+            free(members);
+            return NULL;
+        }
+
+        volume_id = (struct index_entry*)(members[i]->map + get_media_size(&ms) - INDEX_ENTRY_SIZE);
+        if (i == 0) {
+            timestamp = volume_id->volume_id.timestamp;
+        }
+        volume_id->volume_id.timestamp = timestamp;
+        volume_id->volume_id.set_members = count;
+        volume_id->volume_id.set_member = i;
+        volume_id->volume_id.stripe_shift = stripe_shift;
+        members[i]->set_members = count;
+        members[i]->stripe_shift = stripe_shift;
+    }
+
+    members[0]->members = members;
+    return members[0];
+}
+
+/**
+ * Find a logical data block. Returns a pointer into whichever image holds
+ * it, or NULL past the end of the data region. If run isn't NULL it's set
+ * to the number of blocks that follow contiguously from there.
+ */
+char *get_data_block(filesystem *fs, long long block, long long *run)
+{
+    uint32_t bytes_per_block = 1 << (fs->s_block->block_size + 7);
+    filesystem *member = fs;
+    long long member_block = block;
+    long long stripe, within;
+
+    if (fs->set_members > 1) {
+        stripe = block >> fs->stripe_shift;
+        within = block & ((1LL << fs->stripe_shift) - 1);
+        member = fs->members[stripe % fs->set_members];
+        member_block = ((stripe / fs->set_members) << fs->stripe_shift) + within;
+    }
+
+    if (block < 0 || member->data_region + ((member_block + 1) * bytes_per_block) > member->index_region) {
+        return NULL;
+    }
+
+    if (run != NULL) {
+        *run = (member->index_region - member->data_region) / bytes_per_block - member_block;
+        if (fs->set_members > 1 && *run > (1LL << fs->stripe_shift) - within) {
+            *run = (1LL << fs->stripe_shift) - within;
+        }
+    }
+    return member->data_region + (member_block * bytes_per_block);
+}
+
+/**
+ * Find a logical data block for callers that go through file descriptors
+ * rather than the map. Returns the descriptor of the image holding it and
+ * sets offset to its byte offset in that image, or returns -1 past the end
+ * of the data region. run is set as for get_data_block.
+ */
+int get_data_location(filesystem *fs, long long block, long long *offset, long long *run)
+{
+    char *data = get_data_block(fs, block, run);
+    filesystem *member = fs;
+
+    if (data == NULL) {
+        return -1;
+    }
+
+    if (fs->set_members > 1) {
+        member = fs->members[(block >> fs->stripe_shift) % fs->set_members];
+    }
+    *offset = data - member->map;
+    return member->fd;
+}
+
+/**
+ * The number of logical data blocks an image, or a whole volume set, has
+ * room for.
+ */
+long long get_data_blocks(filesystem *fs)
+{
+    uint32_t bytes_per_block = 1 << (fs->s_block->block_size + 7);
+    long long smallest = (fs->index_region - fs->data_region) / bytes_per_block;
+
+    if (fs->set_members <= 1) {
+        return smallest;
+    }
+
+    for (int i = 1; i < fs->set_members; i++) {
+        filesystem *member = fs->members[i];
+        long long blocks = (member->index_region - member->data_region) / bytes_per_block;
+        if (blocks < smallest) {
+            smallest = blocks;
+        }
+    }
+
+    return (smallest >> fs->stripe_shift << fs->stripe_shift) * fs->set_members;
+}
+
 int close_filesystem(filesystem *fs)
 {
+    if (fs->members != NULL) {
+        for (int i = 1; i < fs->set_members; i++) {
+            close_filesystem(fs->members[i]);
+        }
+        free(fs->members);
+    }
+
     munmap(fs->map, get_media_size(fs->s_block));
+    close(fs->fd);
+    free(fs);
     return 1;
 }
+
+/*
+ * Index scanners. Each returns the position of the first entry at or after
+ * start whose type is in type_mask and whose name begins with prefix, or
+ * count if there is none. Glob matching is left to query_next, which only
+ * sees the survivors.
+ */
+typedef long long (*scan_fn)(const struct index_entry *entries, long long start,
+        long long count, uint32_t type_mask, const char *prefix, size_t prefix_len);
+
+#define DIR_NAME_OFFSET     (1 + offsetof(struct dir_entry, dir_name))
+#define FILE_NAME_OFFSET    (1 + offsetof(struct file_entry, file_name))
+
+static int type_matches(uint8_t type, uint32_t type_mask)
+{
+    return type < 32 && (type_mask & TYPE_BIT(type));
+}
+
+static int prefix_matches(const struct index_entry *entry, const char *prefix, size_t prefix_len)
+{
+    size_t name_len;
+
+    if (prefix_len == 0) {
+        return 1;
+    }
+
+    if (entry->type == DIRECTORY_ENTRY) {
+        name_len = sizeof(entry->dir.dir_name);
+    } else if (entry->type == FILE_ENTRY) {
+        name_len = sizeof(entry->file.file_name);
+    } else {
+        return 0;
+    }
+
+    if (prefix_len >= name_len) {
+        return 0;
+    }
+
+    return memcmp(sfs_entry_name((struct index_entry*)entry), prefix, prefix_len) == 0;
+}
+
+static long long scan_scalar(const struct index_entry *entries, long long start,
+        long long count, uint32_t type_mask, const char *prefix, size_t prefix_len)
+{
+    for (long long i = start; i < count; i++) {
+        if (type_matches(entries[i].type, type_mask) &&
+                prefix_matches(&entries[i], prefix, prefix_len)) {
+            return i;
+        }
+    }
+
+    return count;
+}
+
+#ifdef HAVE_X86_SCANNERS
+/**
+ * Load up to the first 16 bytes of the prefix for a vector compare, and
+ * return the movemask bits that have to match.
+ */
+__attribute__((target("sse2")))
+static int load_head(const char *prefix, size_t prefix_len, __m128i *pattern)
+{
+    char head[16] = { 0 };
+    size_t head_len = prefix_len < 16 ? prefix_len : 16;
+
+    memcpy(head, prefix, head_len);
+    *pattern = _mm_loadu_si128((const __m128i*)head);
+
+    return (1 << head_len) - 1;
+}
+
+/**
+ * Compare the first 16 bytes of a named entry against the prefix in one
+ * go. 16 bytes from either name offset stays inside the 64 byte entry.
+ */
+__attribute__((target("sse2")))
+static inline int head_matches(const struct index_entry *entry, __m128i pattern, int head_mask)
+{
+    const char *name = (const char*)entry;
+    __m128i bytes;
+
+    if (entry->type == DIRECTORY_ENTRY) {
+        bytes = _mm_loadu_si128((const __m128i*)(name + DIR_NAME_OFFSET));
+    } else if (entry->type == FILE_ENTRY) {
+        bytes = _mm_loadu_si128((const __m128i*)(name + FILE_NAME_OFFSET));
+    } else {
+        return 0;
+    }
+
+    return (_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, pattern)) & head_mask) == head_mask;
+}
+
+__attribute__((target("sse2")))
+static long long scan_sse2(const struct index_entry *entries, long long start,
+        long long count, uint32_t type_mask, const char *prefix, size_t prefix_len)
+{
+    __m128i pattern;
+    int head_mask = load_head(prefix, prefix_len, &pattern);
+
+    for (long long i = start; i < count; i++) {
+        if (!type_matches(entries[i].type, type_mask)) {
+            continue;
+        }
+
+        if (prefix_len == 0) {
+            return i;
+        }
+
+        if (head_matches(&entries[i], pattern, head_mask) &&
+                (prefix_len <= 16 || prefix_matches(&entries[i], prefix, prefix_len))) {
+            return i;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * AVX2 looks at eight entries at a time. The type bytes are gathered and
+ * tested against the mask with a variable shift, then the first eight name
+ * bytes are gathered from each entry's name offset and compared against
+ * the prefix. Only entries passing both are checked in full.
+ */
+__attribute__((target("avx2")))
+static long long scan_avx2(const struct index_entry *entries, long long start,
+        long long count, uint32_t type_mask, const char *prefix, size_t prefix_len)
+{
+    const __m256i stride = _mm256_setr_epi32(0, 64, 128, 192, 256, 320, 384, 448);
+    const __m256i ones = _mm256_set1_epi32(1);
+    const __m256i low_byte = _mm256_set1_epi32(0xff);
+    const __m256i types_wanted = _mm256_set1_epi32(type_mask);
+    const __m256i dir_type = _mm256_set1_epi32(DIRECTORY_ENTRY);
+    const __m256i file_type = _mm256_set1_epi32(FILE_ENTRY);
+    const __m256i dir_offset = _mm256_add_epi32(stride, _mm256_set1_epi32(DIR_NAME_OFFSET));
+    const __m256i file_offset = _mm256_add_epi32(stride, _mm256_set1_epi32(FILE_NAME_OFFSET));
+    uint64_t head = 0, head_mask;
+    size_t head_len = prefix_len < 8 ? prefix_len : 8;
+    __m256i head_lo, head_hi, mask_lo, mask_hi;
+    __m128i pattern;
+    int pattern_mask = load_head(prefix, prefix_len, &pattern);
+    long long i = start;
+
+    memcpy(&head, prefix, head_len);
+    head_mask = head_len == 8 ? ~0ULL : (1ULL << (head_len * 8)) - 1;
+    head_lo = _mm256_set1_epi32((uint32_t)head);
+    head_hi = _mm256_set1_epi32((uint32_t)(head >> 32));
+    mask_lo = _mm256_set1_epi32((uint32_t)head_mask);
+    mask_hi = _mm256_set1_epi32((uint32_t)(head_mask >> 32));
+
+    for (; i + 8 <= count; i += 8) {
+        const int *base = (const int*)&entries[i];
+        __m256i types = _mm256_and_si256(_mm256_i32gather_epi32(base, stride, 1), low_byte);
+        // sllv gives zero for any shift over 31, so odd types never match
+        __m256i hit = _mm256_and_si256(_mm256_sllv_epi32(ones, types), types_wanted);
+        __m256i is_dir = _mm256_cmpeq_epi32(types, dir_type);
+        __m256i is_named = _mm256_or_si256(is_dir, _mm256_cmpeq_epi32(types, file_type));
+        __m256i offsets = _mm256_blendv_epi8(file_offset, dir_offset, is_dir);
+        __m256i lo = _mm256_i32gather_epi32(base, offsets, 1);
+        __m256i name_hit = _mm256_cmpeq_epi32(_mm256_and_si256(lo, mask_lo), head_lo);
+
+        hit = _mm256_xor_si256(_mm256_cmpeq_epi32(hit, _mm256_setzero_si256()), _mm256_set1_epi32(-1));
+        hit = _mm256_and_si256(hit, _mm256_and_si256(name_hit, is_named));
+
+        // Only pay for the second gather when some lane is still alive
+        if (head_len > 4 && !_mm256_testz_si256(hit, hit)) {
+            __m256i hi = _mm256_i32gather_epi32(base, _mm256_add_epi32(offsets, _mm256_set1_epi32(4)), 1);
+            hit = _mm256_and_si256(hit, _mm256_cmpeq_epi32(_mm256_and_si256(hi, mask_hi), head_hi));
+        }
+
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+        while (mask) {
+            int lane = __builtin_ctz(mask);
+            if (prefix_len <= 8 || (head_matches(&entries[i + lane], pattern, pattern_mask) &&
+                    (prefix_len <= 16 || prefix_matches(&entries[i + lane], prefix, prefix_len)))) {
+                return i + lane;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return scan_scalar(entries, i, count, type_mask, prefix, prefix_len);
+}
+#endif
+
+// The scanner query_next uses, picked on first use
+static scan_fn scan = NULL;
+
+static scan_fn pick_scanner(void)
+{
+#ifdef HAVE_X86_SCANNERS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return scan_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return scan_sse2;
+    }
+#endif
+    return scan_scalar;
+}
+
+/**
+ * Make query_next use the named scanner, "scalar", "sse2" or "avx2",
+ * instead of the best one for this CPU. Used to compare them.
+ * Returns 1 if the scanner is available, 0 if not.
+ */
+int query_use_scanner(const char *name)
+{
+    if (strcmp(name, "scalar") == 0) {
+        scan = scan_scalar;
+        return 1;
+    }
+#ifdef HAVE_X86_SCANNERS
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        scan = scan_sse2;
+        return 1;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        scan = scan_avx2;
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+void query_init(query *q, filesystem *fs, uint32_t type_mask, const char *pattern)
+{
+    memset(q, 0, sizeof(query));
+    q->fs = fs;
+    q->type_mask = type_mask;
+    q->pattern = pattern;
+
+    if (pattern != NULL) {
+        // The scanners only ever see the literal text ahead of the first
+        // wildcard. fnmatch checks the rest.
+        q->prefix_len = strcspn(pattern, "*?[\\");
+        q->glob = pattern[q->prefix_len] != '\0';
+    }
+}
+
+/**
+ * Returns the next matching entry, or NULL once the index is exhausted.
+ */
+struct index_entry *query_next(query *q)
+{
+    struct index_entry *entries = (struct index_entry *)q->fs->index_region;
+    long long count = q->fs->s_block->index_bytes / INDEX_ENTRY_SIZE;
+    long long found;
+    const char *prefix = q->pattern != NULL ? q->pattern : "";
+    char *name;
+
+    if (scan == NULL) {
+        scan = pick_scanner();
+    }
+
+    while (q->next < count) {
+        // A type-only query is one byte per cache line, which the plain
+        // loop already does at memory speed. The vector scanners only pay
+        // off once there are name bytes to compare.
+        if (q->prefix_len == 0) {
+            found = scan_scalar(entries, q->next, count, q->type_mask, prefix, 0);
+        } else {
+            found = scan(entries, q->next, count, q->type_mask, prefix, q->prefix_len);
+        }
+        if (found >= count) {
+            break;
+        }
+
+        q->next = found + 1;
+        if (!q->glob) {
+            return &entries[found];
+        }
+
+        name = sfs_entry_name(&entries[found]);
+        if (name != NULL && fnmatch(q->pattern, name, 0) == 0) {
+            return &entries[found];
+        }
+    }
+
+    q->next = count;
+    return NULL;
+}
@@ -0,0 +1,288 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "common.h"
+
+/*
+ * Image analysis for mksfs -s. One pass over the index gathers entry
+ * counts, name lengths and extents, then the extents are sorted to find
+ * how the data region is laid out. The report is plain text or JSON.
+ */
+
+#define NAME_BUCKETS    8       // 8 characters per bucket, names are at most 54
+#define EXTENT_BUCKETS  16      // Powers of two in blocks, the last holds anything larger
+
+typedef struct extent {
+    long long first;
+    long long last;
+} extent;
+
+typedef struct fs_stats {
+    long long entries;
+    long long by_type[32];
+    long long other_types;
+    long long named;
+    long long name_lengths[NAME_BUCKETS];
+    long long extent_sizes[EXTENT_BUCKETS];
+    long long extents;
+    long long shared_extents;
+    long long position_total;   // Sum of scan positions of named entries
+    long long data_blocks;      // Blocks between the reserved area and the index
+    long long used_blocks;
+    long long free_blocks;
+    long long gaps;
+    long long largest_free;
+    long long index_blocks;
+    long long bad_extents;
+} fs_stats;
+
+static int extent_cmp(const void *a, const void *b)
+{
+    const extent *x = a, *y = b;
+
+    if (x->first != y->first) {
+        return x->first < y->first ? -1 : 1;
+    }
+    return x->last < y->last ? -1 : (x->last > y->last);
+}
+
+static int extent_bucket(long long blocks)
+{
+    int bucket = 0;
+
+    while (bucket < EXTENT_BUCKETS - 1 && (1LL << bucket) < blocks) {
+        bucket++;
+    }
+
+    return bucket;
+}
+
+/**
+ * Sort and merge the extents, counting shared ones, then walk the data
+ * region for the free gaps between them.
+ */
+static void layout_stats(fs_stats *st, extent *extents, long long count)
+{
+    long long next_free = 0;
+
+    qsort(extents, count, sizeof(extent), extent_cmp);
+
+    for (long long i = 0; i < count; i++) {
+        if (i > 0 && extents[i].first == extents[i - 1].first &&
+                extents[i].last == extents[i - 1].last) {
+            st->shared_extents++;
+            continue;
+        }
+
+        st->extents++;
+        st->extent_sizes[extent_bucket(extents[i].last - extents[i].first + 1)]++;
+
+        if (extents[i].first > next_free) {
+            long long gap = extents[i].first - next_free;
+            st->gaps++;
+            st->free_blocks += gap;
+            if (gap > st->largest_free) {
+                st->largest_free = gap;
+            }
+        }
+        if (extents[i].last + 1 > next_free) {
+            next_free = extents[i].last + 1;
+        }
+    }
+
+    // Whatever is left between the last extent and the index
+    if (st->data_blocks > next_free) {
+        long long gap = st->data_blocks - next_free;
+        st->gaps++;
+        st->free_blocks += gap;
+        if (gap > st->largest_free) {
+            st->largest_free = gap;
+        }
+    }
+
+    st->used_blocks = st->data_blocks - st->free_blocks;
+}
+
+static int collect_stats(filesystem *fs, fs_stats *st)
+{
+    superblock *s = fs->s_block;
+    uint32_t bytes_per_block = 1 << (s->block_size + 7);
+    long long media_size = get_media_size(s);
+    long long index_start = media_size - s->index_bytes;
+    struct index_entry *entry = (struct index_entry*)fs->index_region;
+    extent *extents;
+    long long count = 0;
+
+    memset(st, 0, sizeof(fs_stats));
+    st->entries = s->index_bytes / INDEX_ENTRY_SIZE;
+    st->data_blocks = (index_start / bytes_per_block) - s->reserved_blocks;
+    if (fs->set_members > 1) {
+        st->data_blocks = get_data_blocks(fs);
+    }
+    st->index_blocks = (media_size / bytes_per_block) - (index_start / bytes_per_block);
+
+    extents = calloc(st->entries + 1, sizeof(extent));
+    if (extents == NULL) {
+        perror("Allocating extents");
+        return -1;
+    }
+
+    for (long long i = 0; i < st->entries; i++, entry++) {
+        char *name = sfs_entry_name(entry);
+
+        if (entry->type < 32) {
+            st->by_type[entry->type]++;
+        } else {
+            st->other_types++;
+        }
+
+        if (name != NULL) {
+            size_t len = strnlen(name, entry->type == DIRECTORY_ENTRY ?
+                    sizeof(entry->dir.dir_name) : sizeof(entry->file.file_name));
+            int bucket = len / 8;
+
+            st->named++;
+            st->name_lengths[bucket < NAME_BUCKETS ? bucket : NAME_BUCKETS - 1]++;
+            st->position_total += i + 1;
+        }
+
+        // Unusable entries mark bad blocks, which are as good as used
+        if (entry->type == FILE_ENTRY || entry->type == UNUSABLE_ENTRY) {
+            long long first = entry->type == FILE_ENTRY ?
+                entry->file.starting_block : entry->unusable.starting_block;
+            long long last = entry->type == FILE_ENTRY ?
+                entry->file.ending_block : entry->unusable.ending_block;
+
+            if (first < 0 || last < first || last >= st->data_blocks) {
+                st->bad_extents++;
+                continue;
+            }
+            extents[count].first = first;
+            extents[count].last = last;
+            count++;
+        }
+    }
+
+    layout_stats(st, extents, count);
+    free(extents);
+    return 0;
+}
+
+static double ratio(long long part, long long whole)
+{
+    return whole > 0 ? (double)part / whole : 0.0;
+}
+
+static void print_text(filesystem *fs, fs_stats *st)
+{
+    superblock *s = fs->s_block;
+    long long deleted = st->by_type[DEL_DIRECTORY_ENTRY] + st->by_type[DEL_FILE_ENTRY];
+    long long unused = st->by_type[UNUSED_ENTRY];
+
+    printf("Index\n");
+    printf("  entries            %lld in %lld blocks\n", st->entries, st->index_blocks);
+    printf("  directories        %lld\n", st->by_type[DIRECTORY_ENTRY]);
+    printf("  files              %lld\n", st->by_type[FILE_ENTRY]);
+    printf("  deleted            %lld (%.1f%%)\n", deleted, 100 * ratio(deleted, st->entries));
+    printf("  unused             %lld (%.1f%%)\n", unused, 100 * ratio(unused, st->entries));
+    printf("  unusable           %lld\n", st->by_type[UNUSABLE_ENTRY]);
+    printf("  other              %lld\n", st->entries - st->by_type[DIRECTORY_ENTRY] -
+            st->by_type[FILE_ENTRY] - deleted - unused - st->by_type[UNUSABLE_ENTRY]);
+
+    printf("Name lengths\n");
+    for (int i = 0; i < NAME_BUCKETS; i++) {
+        printf("  %2d-%-2d              %lld\n", i * 8, i * 8 + 7, st->name_lengths[i]);
+    }
+
+    printf("Extent sizes (blocks)\n");
+    for (int i = 0; i < EXTENT_BUCKETS; i++) {
+        if (st->extent_sizes[i] == 0) {
+            continue;
+        }
+        if (i == EXTENT_BUCKETS - 1) {
+            printf("  >  %-16lld%lld\n", 1LL << (i - 1), st->extent_sizes[i]);
+        } else {
+            printf("  <= %-16lld%lld\n", 1LL << i, st->extent_sizes[i]);
+        }
+    }
+    printf("  shared             %lld\n", st->shared_extents);
+    printf("  out of range       %lld\n", st->bad_extents);
+
+    printf("Data region\n");
+    printf("  blocks             %lld\n", st->data_blocks);
+    printf("  used               %lld (%.1f%%)\n", st->used_blocks,
+            100 * ratio(st->used_blocks, st->data_blocks));
+    printf("  free               %lld in %lld gaps\n", st->free_blocks, st->gaps);
+    printf("  largest free       %lld\n", st->largest_free);
+
+    printf("Lookup cost\n");
+    printf("  scan, hit          %.1f entries on average\n", ratio(st->position_total, st->named));
+    printf("  scan, miss         %lld entries\n", st->entries);
+    printf("  cold index load    %lld blocks\n", st->index_blocks);
+    if (s->features & SFS_FEATURE_NAME_HASH) {
+        printf("  name hash          %u slots, %s\n", s->hash_slots,
+                s->hash_index_bytes == s->index_bytes ? "current" : "stale");
+    } else {
+        printf("  name hash          none\n");
+    }
+}
+
+static void print_json(filesystem *fs, fs_stats *st)
+{
+    superblock *s = fs->s_block;
+
+    printf("{\n  \"index\": {\"entries\": %lld, \"blocks\": %lld, \"directories\": %lld, "
+            "\"files\": %lld, \"deleted_directories\": %lld, \"deleted_files\": %lld, "
+            "\"unused\": %lld, \"unusable\": %lld, \"deleted_ratio\": %.4f, "
+            "\"unused_ratio\": %.4f},\n",
+            st->entries, st->index_blocks, st->by_type[DIRECTORY_ENTRY], st->by_type[FILE_ENTRY],
+            st->by_type[DEL_DIRECTORY_ENTRY], st->by_type[DEL_FILE_ENTRY],
+            st->by_type[UNUSED_ENTRY], st->by_type[UNUSABLE_ENTRY],
+            ratio(st->by_type[DEL_DIRECTORY_ENTRY] + st->by_type[DEL_FILE_ENTRY], st->entries),
+            ratio(st->by_type[UNUSED_ENTRY], st->entries));
+
+    printf("  \"name_lengths\": [");
+    for (int i = 0; i < NAME_BUCKETS; i++) {
+        printf("%s%lld", i ? ", " : "", st->name_lengths[i]);
+    }
+    printf("],\n");
+
+    printf("  \"extents\": {\"count\": %lld, \"shared\": %lld, \"out_of_range\": %lld, "
+            "\"size_log2\": [",
+            st->extents, st->shared_extents, st->bad_extents);
+    for (int i = 0; i < EXTENT_BUCKETS; i++) {
+        printf("%s%lld", i ? ", " : "", st->extent_sizes[i]);
+    }
+    printf("]},\n");
+
+    printf("  \"data\": {\"blocks\": %lld, \"used\": %lld, \"free\": %lld, \"gaps\": %lld, "
+            "\"largest_free\": %lld},\n",
+            st->data_blocks, st->used_blocks, st->free_blocks, st->gaps, st->largest_free);
+
+    printf("  \"lookup\": {\"scan_hit_entries\": %.1f, \"scan_miss_entries\": %lld, "
+            "\"cold_load_blocks\": %lld, \"name_hash\": \"%s\"}\n}\n",
+            ratio(st->position_total, st->named), st->entries, st->index_blocks,
+            !(s->features & SFS_FEATURE_NAME_HASH) ? "none" :
+            s->hash_index_bytes == s->index_bytes ? "current" : "stale");
+}
+
+int print_stats(filesystem *fs, int json)
+{
+    fs_stats st;
+
+    if (collect_stats(fs, &st) < 0) {
+        return -1;
+    }
+
+    if (json) {
+        print_json(fs, &st);
+    } else {
+        print_text(fs, &st);
+    }
+
+    return 0;
+}
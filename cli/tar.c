@@ -0,0 +1,623 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "common.h"
+
+/*
+ * Conversion between tar streams and images for mksfs --from-tar and
+ * --to-tar. Tar pads every member to 512 bytes, the same as an SFS block,
+ * so file data is copied straight through a block at a time. Nothing is
+ * buffered beyond a small copy buffer and one index entry per member.
+ */
+
+#define TAR_BLOCK       512
+#define TAR_RECORD      (20 * TAR_BLOCK)
+#define TAR_COPY_BLOCKS 128
+#define TAR_LONG_NAME   4096    // Longer names can't fit an entry anyway
+
+typedef struct __attribute__((__packed__)) tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tar_header;
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = read(fd, (char*)buf + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return done == 0 && n == 0 ? 0 : -1;
+        }
+        done += n;
+    }
+
+    return 1;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = write(fd, (const char*)buf + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+
+    return 0;
+}
+
+/**
+ * Parse a numeric header field. Values too large for octal are stored
+ * base-256, flagged by the top bit of the first byte.
+ */
+static long long tar_number(const char *field, size_t len)
+{
+    long long value = 0;
+    size_t i = 0;
+
+    if ((uint8_t)field[0] & 0x80) {
+        value = (uint8_t)field[0] & 0x7f;
+        for (i = 1; i < len; i++) {
+            value = (value << 8) | (uint8_t)field[i];
+        }
+        return value;
+    }
+
+    while (i < len && (field[i] == ' ' || field[i] == '\0')) {
+        i++;
+    }
+    while (i < len && field[i] >= '0' && field[i] <= '7') {
+        value = (value << 3) | (field[i] - '0');
+        i++;
+    }
+
+    return value;
+}
+
+static void tar_set_number(char *field, size_t len, long long value)
+{
+    if (value >= 1LL << (3 * (len - 1))) {
+        memset(field, 0, len);
+        for (size_t i = len - 1; i > 0; i--) {
+            field[i] = value & 0xff;
+            value >>= 8;
+        }
+        field[0] = (char)0x80;
+        return;
+    }
+
+    snprintf(field, len, "%0*llo", (int)len - 1, value);
+}
+
+static unsigned int tar_checksum(const tar_header *h)
+{
+    const uint8_t *p = (const uint8_t*)h;
+    unsigned int sum = 0;
+
+    for (size_t i = 0; i < sizeof(tar_header); i++) {
+        if (i >= offsetof(tar_header, chksum) && i < offsetof(tar_header, chksum) + sizeof(h->chksum)) {
+            sum += ' ';
+        } else {
+            sum += p[i];
+        }
+    }
+
+    return sum;
+}
+
+/**
+ * Build the SFS name of a member from its long name, if a pax or GNU
+ * header gave one, or else its ustar prefix and name. Any leading "/" or
+ * "./" is dropped and, for directories, the trailing "/".
+ * Returns the name length, which is 0 for the archive's own "./", or -1
+ * if it doesn't fit in len bytes.
+ */
+static int tar_member_name(const tar_header *h, const char *long_name, char *name, size_t len)
+{
+    char full[TAR_LONG_NAME];
+    char *p = full;
+    size_t n;
+
+    if (long_name != NULL) {
+        snprintf(full, sizeof(full), "%s", long_name);
+    } else if (h->prefix[0] != '\0' && memcmp(h->magic, "ustar", 5) == 0) {
+        snprintf(full, sizeof(full), "%.*s/%.*s", (int)sizeof(h->prefix), h->prefix,
+                (int)sizeof(h->name), h->name);
+    } else {
+        snprintf(full, sizeof(full), "%.*s", (int)sizeof(h->name), h->name);
+    }
+
+    while (*p == '/' || (p[0] == '.' && p[1] == '/')) {
+        p += (*p == '/') ? 1 : 2;
+    }
+    n = strlen(p);
+    while (n > 0 && p[n - 1] == '/') {
+        p[--n] = '\0';
+    }
+
+    if (n >= len) {
+        return -1;
+    }
+    memcpy(name, p, n + 1);
+    return n;
+}
+
+/**
+ * Copy blocks of member data from a tar stream, writing them to out_fd
+ * unless it's -1. The final block is zero filled past length.
+ */
+static int tar_copy_data(int in_fd, int out_fd, char *buf, long long length)
+{
+    long long blocks = (length + TAR_BLOCK - 1) / TAR_BLOCK;
+    long long chunk;
+
+    while (blocks > 0) {
+        chunk = blocks < TAR_COPY_BLOCKS ? blocks : TAR_COPY_BLOCKS;
+        if (read_full(in_fd, buf, chunk * TAR_BLOCK) != 1) {
+            return -1;
+        }
+        if (out_fd >= 0 && write_full(out_fd, buf, chunk * TAR_BLOCK) < 0) {
+            return -1;
+        }
+        blocks -= chunk;
+    }
+
+    return 0;
+}
+
+/**
+ * Read the data of an extended header, a GNU long name or pax records,
+ * into buf, which holds TAR_COPY_BLOCKS blocks. The data is NUL
+ * terminated. Returns 0, -1 if the stream ends early, or -2 if the data
+ * doesn't fit.
+ */
+static int tar_read_extended(int in_fd, char *buf, long long length)
+{
+    long long blocks = (length + TAR_BLOCK - 1) / TAR_BLOCK;
+
+    if (length < 0 || length >= TAR_COPY_BLOCKS * TAR_BLOCK) {
+        return -2;
+    }
+    if (blocks > 0 && read_full(in_fd, buf, blocks * TAR_BLOCK) != 1) {
+        return -1;
+    }
+    buf[length] = '\0';
+
+    return 0;
+}
+
+/**
+ * Pick the path and size records out of pax extended header data. Each
+ * record is "<length> <key>=<value>\n", the length counting the whole
+ * record. Returns 0, or -1 if a record is malformed.
+ */
+static int tar_parse_pax(const char *data, long long length, char *path, int *have_path,
+        long long *size)
+{
+    const char *p = data, *end = data + length;
+
+    while (p < end) {
+        const char *key, *value, *record_end;
+        char *after;
+        long long record = strtoll(p, &after, 10);
+
+        if (after == p || *after != ' ' || record <= 0 || record > end - p) {
+            return -1;
+        }
+        record_end = p + record - 1;
+        if (*record_end != '\n') {
+            return -1;
+        }
+
+        key = after + 1;
+        value = memchr(key, '=', record_end - key);
+        if (value == NULL) {
+            return -1;
+        }
+        value++;
+
+        if (value - key == 5 && memcmp(key, "path=", 5) == 0) {
+            size_t len = record_end - value;
+
+            // Anything longer won't fit an entry, so keep it too long
+            if (len >= TAR_LONG_NAME) {
+                len = TAR_LONG_NAME - 1;
+            }
+            memcpy(path, value, len);
+            path[len] = '\0';
+            *have_path = 1;
+        } else if (value - key == 5 && memcmp(key, "size=", 5) == 0) {
+            *size = strtoll(value, NULL, 10);
+        }
+
+        p = record_end + 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Build a new image in fd from the tar stream on in_fd. File data is
+ * appended to the data region as it arrives and index entries are kept
+ * in memory, then the index and superblock are written once the stream
+ * ends. Regular files and directories are kept, any other member is
+ * skipped with a warning. Long names from pax path records and GNU L
+ * members are honoured, as are pax sizes. Returns the number of entries
+ * added, or -1.
+ */
+int tar_to_image(int in_fd, int fd)
+{
+    uint32_t bytes_per_block = 1 << (2 + 7);
+    char *buf = malloc(TAR_COPY_BLOCKS * TAR_BLOCK);
+    struct index_entry *entries = NULL;
+    long long count = 0, capacity = 0;
+    long long next_block = 0;
+    long long length, index_blocks;
+    char name[sizeof(((struct dir_entry*)0)->dir_name)];
+    char long_name[TAR_LONG_NAME];
+    int have_long_name = 0;
+    long long pax_size = -1;
+    const char *path;
+    int shown_len;
+    tar_header h;
+    superblock s;
+    int ret = -1;
+    int zero_blocks = 0;
+    int r, n;
+
+    if (buf == NULL || lseek(fd, bytes_per_block, SEEK_SET) < 0) {
+        perror("Creating image");
+        free(buf);
+        return -1;
+    }
+
+    while ((r = read_full(in_fd, &h, sizeof(h))) == 1) {
+        if (h.name[0] == '\0') {
+            // Two zero blocks end the archive
+            if (++zero_blocks == 2) {
+                break;
+            }
+            continue;
+        }
+        zero_blocks = 0;
+
+        if ((unsigned int)tar_number(h.chksum, sizeof(h.chksum)) != tar_checksum(&h)) {
+            printf("Bad tar header checksum\n");
+            goto out;
+        }
+
+        length = tar_number(h.size, sizeof(h.size));
+
+        // A GNU long name or pax header describes the member after it
+        if (h.typeflag == 'L' || h.typeflag == 'x') {
+            r = tar_read_extended(in_fd, buf, length);
+            if (r == -2) {
+                printf("Extended header %.100s is too large\n", h.name);
+                goto out;
+            } else if (r < 0) {
+                goto truncated;
+            }
+
+            if (h.typeflag == 'L') {
+                snprintf(long_name, sizeof(long_name), "%s", buf);
+                have_long_name = 1;
+            } else if (tar_parse_pax(buf, length, long_name, &have_long_name, &pax_size) < 0) {
+                printf("Bad pax header %.100s\n", h.name);
+                goto out;
+            }
+            continue;
+        }
+
+        path = have_long_name ? long_name : NULL;
+        shown_len = have_long_name ? (int)strlen(long_name) : (int)sizeof(h.name);
+        if (pax_size >= 0) {
+            length = pax_size;
+        }
+        have_long_name = 0;
+        pax_size = -1;
+
+        if (h.typeflag != '0' && h.typeflag != '\0' && h.typeflag != '5') {
+            // Links, devices, long link names and global headers have no
+            // SFS equivalent
+            if (h.typeflag != 'K' && h.typeflag != 'g') {
+                printf("Skipping %.*s: not a regular file or directory\n", shown_len,
+                        path != NULL ? path : h.name);
+            }
+            if (tar_copy_data(in_fd, -1, buf, length) < 0) {
+                goto truncated;
+            }
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct index_entry *grown = realloc(entries, capacity * sizeof(struct index_entry));
+            if (grown == NULL) {
+                perror("Index entries");
+                goto out;
+            }
+            entries = grown;
+        }
+        struct index_entry *entry = &entries[count];
+        memset(entry, 0, sizeof(struct index_entry));
+
+        if (h.typeflag == '5') {
+            n = tar_member_name(&h, path, name, sizeof(entry->dir.dir_name));
+            if (n == 0) {
+                continue;
+            } else if (n < 0) {
+                printf("Skipping directory %.*s: name must be 1 to %zu characters\n", shown_len,
+                        path != NULL ? path : h.name, sizeof(entry->dir.dir_name) - 1);
+                continue;
+            }
+            entry->type = DIRECTORY_ENTRY;
+            strcpy(entry->dir.dir_name, name);
+            entry->dir.timestamp = tar_number(h.mtime, sizeof(h.mtime)) * 1000;
+            count++;
+            continue;
+        }
+
+        if (tar_member_name(&h, path, name, sizeof(entry->file.file_name)) <= 0) {
+            printf("Skipping %.*s: name must be 1 to %zu characters\n", shown_len,
+                    path != NULL ? path : h.name, sizeof(entry->file.file_name) - 1);
+            if (tar_copy_data(in_fd, -1, buf, length) < 0) {
+                goto truncated;
+            }
+            continue;
+        }
+
+        entry->type = FILE_ENTRY;
+        strcpy(entry->file.file_name, name);
+        entry->file.timestamp = tar_number(h.mtime, sizeof(h.mtime)) * 1000;
+        entry->file.length = length;
+        entry->file.starting_block = next_block;
+
+        if (length > 0) {
+            if (tar_copy_data(in_fd, fd, buf, length) < 0) {
+                goto truncated;
+            }
+            next_block += (length + bytes_per_block - 1) / bytes_per_block;
+        } else {
+            // Empty files still get a block of their own, as with add_file
+            memset(buf, 0, bytes_per_block);
+            if (write_full(fd, buf, bytes_per_block) < 0) {
+                perror("Writing image");
+                goto out;
+            }
+            next_block++;
+        }
+        entry->file.ending_block = next_block - 1;
+        count++;
+    }
+
+    if (r < 0) {
+        goto truncated;
+    }
+
+    // Lay out the index behind the data: the starting marker lowest, then
+    // the members newest first, then the Volume ID at the end of the media.
+    memset(&s, 0, sizeof(superblock));
+    s.block_size = 2;
+    s.reserved_blocks = 1;
+    s.data_blocks = next_block;
+    s.index_bytes = (count + 2) * INDEX_ENTRY_SIZE;
+    index_blocks = (s.index_bytes + bytes_per_block - 1) / bytes_per_block;
+    s.total_blocks = s.reserved_blocks + s.data_blocks + index_blocks;
+    s.alteration_time = get_milliseconds();
+    strcpy(s.magic, "\x53\x46\x53\x10");
+    s.checksum = superblock_calc_checksum(&s);
+
+    if (ftruncate(fd, get_media_size(&s)) < 0 ||
+            lseek(fd, get_media_size(&s) - s.index_bytes, SEEK_SET) < 0) {
+        perror("Writing image");
+        goto out;
+    }
+
+    struct index_entry special;
+    memset(&special, 0, sizeof(special));
+    special.type = STARTING_MARKER_ENTRY;
+    special.first_entry.next_starting_block = next_block;
+    if (write_full(fd, &special, sizeof(special)) < 0) {
+        perror("Writing index");
+        goto out;
+    }
+    for (long long i = count - 1; i >= 0; i--) {
+        if (write_full(fd, &entries[i], sizeof(struct index_entry)) < 0) {
+            perror("Writing index");
+            goto out;
+        }
+    }
+    memset(&special, 0, sizeof(special));
+    special.type = VOLUME_ID_ENTRY;
+    special.volume_id.timestamp = get_milliseconds();
+    strcpy(special.volume_id.volume_name, "The Header");
+    if (write_full(fd, &special, sizeof(special)) < 0) {
+        perror("Writing index");
+        goto out;
+    }
+
+    if (pwrite(fd, &s, sizeof(superblock), SUPERBLOCK_OFFSET) != sizeof(superblock)) {
+        perror("Writing superblock");
+        goto out;
+    }
+
+    ret = count;
+    goto out;
+
+truncated:
+    printf("Tar stream ended early\n");
+out:
+    free(entries);
+    free(buf);
+    return ret;
+}
+
+static int extent_order(const void *a, const void *b)
+{
+    const struct index_entry *x = *(const struct index_entry * const *)a;
+    const struct index_entry *y = *(const struct index_entry * const *)b;
+
+    if (x->type != y->type) {
+        // Directories first, they have no data
+        return x->type == DIRECTORY_ENTRY ? -1 : 1;
+    }
+    if (x->type == FILE_ENTRY && x->file.starting_block != y->file.starting_block) {
+        return x->file.starting_block < y->file.starting_block ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Write one member, its data taken a contiguous piece at a time so that
+ * volume sets are handled too.
+ */
+static int tar_write_member(filesystem *fs, int out_fd, struct index_entry *entry)
+{
+    tar_header h;
+    long long timestamp;
+    long long offset = 0;
+    view v;
+
+    memset(&h, 0, sizeof(h));
+    if (entry->type == DIRECTORY_ENTRY) {
+        snprintf(h.name, sizeof(h.name), "%.*s/", (int)sizeof(entry->dir.dir_name), entry->dir.dir_name);
+        tar_set_number(h.mode, sizeof(h.mode), 0755);
+        h.typeflag = '5';
+        timestamp = entry->dir.timestamp;
+    } else {
+        snprintf(h.name, sizeof(h.name), "%.*s", (int)sizeof(entry->file.file_name), entry->file.file_name);
+        tar_set_number(h.mode, sizeof(h.mode), 0644);
+        tar_set_number(h.size, sizeof(h.size), entry->file.length);
+        h.typeflag = '0';
+        timestamp = entry->file.timestamp;
+    }
+    tar_set_number(h.uid, sizeof(h.uid), 0);
+    tar_set_number(h.gid, sizeof(h.gid), 0);
+    tar_set_number(h.mtime, sizeof(h.mtime), timestamp > 0 ? timestamp / 1000 : 0);
+    memcpy(h.magic, "ustar", 6);
+    memcpy(h.version, "00", 2);
+    snprintf(h.chksum, sizeof(h.chksum), "%06o", tar_checksum(&h));
+    h.chksum[7] = ' ';
+
+    if (write_full(out_fd, &h, sizeof(h)) < 0) {
+        return -1;
+    }
+    if (entry->type != FILE_ENTRY) {
+        return 0;
+    }
+
+    while (offset < entry->file.length) {
+        if (view_file_chunk(fs, entry, offset, &v) < 0 || v.len == 0) {
+            return -1;
+        }
+        advise_view(&v, ADVISE_SEQUENTIAL);
+        if (write_full(out_fd, v.ptr, v.len) < 0) {
+            return -1;
+        }
+        offset += v.len;
+    }
+    if (offset % TAR_BLOCK) {
+        char pad[TAR_BLOCK] = {0};
+        return write_full(out_fd, pad, TAR_BLOCK - (offset % TAR_BLOCK));
+    }
+
+    return 0;
+}
+
+/**
+ * Write every directory and file in an image to out_fd as a tar stream.
+ * Files go out in extent order, so the image is read front to back.
+ * Returns the number of members written, or -1.
+ */
+int image_to_tar(filesystem *fs, int out_fd)
+{
+    uint32_t bytes_per_block = 1 << (fs->s_block->block_size + 7);
+    struct index_entry **members = NULL;
+    struct index_entry *entry;
+    long long count = 0, capacity = 0, written = 0;
+    char pad[TAR_BLOCK] = {0};
+    query q;
+    int ret = -1;
+
+    query_init(&q, fs, TYPE_BIT(DIRECTORY_ENTRY) | TYPE_BIT(FILE_ENTRY), NULL);
+    while ((entry = query_next(&q)) != NULL) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct index_entry **grown = realloc(members, capacity * sizeof(*members));
+            if (grown == NULL) {
+                perror("Index entries");
+                free(members);
+                return -1;
+            }
+            members = grown;
+        }
+        members[count++] = entry;
+    }
+    qsort(members, count, sizeof(*members), extent_order);
+
+    for (long long i = 0; i < count; i++) {
+        long long length = members[i]->type == FILE_ENTRY ? members[i]->file.length : 0;
+
+        // The whole extent has to be there before the header goes out
+        if (length > 0 && get_data_block(fs, members[i]->file.starting_block +
+                    (length - 1) / bytes_per_block, NULL) == NULL) {
+            // stdout may be carrying the archive
+            fprintf(stderr, "Skipping %s: extent is outside the data region\n", members[i]->file.file_name);
+            continue;
+        }
+
+        if (tar_write_member(fs, out_fd, members[i]) < 0) {
+            perror("Writing tar");
+            goto out;
+        }
+        written += sizeof(tar_header) + (length + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    }
+
+    // Two zero blocks end the archive, then pad out the last record
+    for (int zeros = 0; zeros < 2 || written % TAR_RECORD != 0; zeros++) {
+        if (write_full(out_fd, pad, sizeof(pad)) < 0) {
+            perror("Writing tar");
+            goto out;
+        }
+        written += sizeof(pad);
+    }
+
+    ret = count;
+out:
+    free(members);
+    return ret;
+}
@@ -8,6 +8,8 @@
 #ifndef SFS_H
 #define	SFS_H
 
+#include <linux/ioctl.h>
+
 #define SFS_MAGIC_NUMBER	0x10534653
 
 #define SUPERBLOCK_OFFSET   0x0194
@@ -26,6 +28,13 @@
 #define DEL_DIRECTORY_ENTRY     0x19
 #define DEL_FILE_ENTRY          0x1A
 
+// Optional features, flagged in superblock.features
+#define SFS_FEATURE_NAME_HASH   0x0001
+#define SFS_FEATURE_CHECKSUMS   0x0002
+#define SFS_FEATURE_VOLUME_SET  0x0004  // One image of a striped set
+
+#define NAME_HASH_SLOT_SIZE     0x08
+
 typedef struct superblock {
     long long alteration_time;
     long long data_blocks;
@@ -39,6 +48,11 @@ typedef struct superblock {
     unsigned int reserved_blocks;
     uint8_t block_size;
     uint8_t checksum;
+    uint16_t features;
+    uint32_t hash_slots;        // Power of two
+    long long hash_block;       // First block of the name hash table
+    long long hash_index_bytes; // index_bytes when the table was built
+    long long csum_block;       // First block of the data block checksums
 } superblock;
 
 typedef struct filesystem {
@@ -48,10 +62,21 @@ typedef struct filesystem {
     char *data_region;
     char *free_region;
     char *index_region;
+    int set_members;                // Images in a volume set, 0 or 1 if alone
+    int stripe_shift;
+    struct filesystem **members;    // Every image of the set, this one first
 } filesystem;
 
+/**
+ * Images in a volume set share one index, held by member 0, and stripe the
+ * data region across all of them. Logical data block b lives in stripe
+ * b >> stripe_shift, and stripe n is stripe n / set_members of member
+ * n % set_members. Every member carries the same timestamp.
+ */
 typedef struct __attribute__((__packed__)) volume_id_entry {
-    char unused[3];
+    uint8_t set_members;    // 0 for an image on its own
+    uint8_t set_member;
+    uint8_t stripe_shift;   // log2 of the stripe size in blocks
     long long timestamp;
     char volume_name[52];
 } volume_id_entry;
@@ -95,5 +120,78 @@ typedef struct __attribute__((__packed__)) index_entry {
     
 } index_entry;
 
+/**
+ * A slot in the on-disk name hash table. The table lives in the reserved
+ * blocks and uses linear probing. entry counts index entries back from the
+ * end of the media, so the Volume ID entry is 1. An entry of 0 is empty.
+ */
+typedef struct __attribute__((__packed__)) name_hash_slot {
+    uint32_t hash;
+    uint32_t entry;
+} name_hash_slot;
+
+/**
+ * FNV-1a over a NUL terminated name. Shared by mksfs and the module, so
+ * it must not change without bumping the on-disk format.
+ */
+static inline uint32_t sfs_name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Returns the name of a directory or file entry, or NULL for any other
+ * kind of entry.
+ */
+static inline char *sfs_entry_name(struct index_entry *entry)
+{
+    if (entry->type == DIRECTORY_ENTRY) {
+        return entry->dir.dir_name;
+    } else if (entry->type == FILE_ENTRY) {
+        return entry->file.file_name;
+    }
+
+    return NULL;
+}
+
+/**
+ * SFS_IOC_LIST_ENTRIES, issued on the root of a mounted filesystem, copies
+ * out up to count directory and file entries in one call, straight from
+ * the cached index. Set cursor to 0 for the first call and pass it back
+ * unchanged after that. On return count holds the number of entries
+ * filled in, which is 0 once every entry has been listed. Entries added
+ * between calls are returned by later calls; nothing is returned twice.
+ */
+struct sfs_entry_info {
+    int64_t timestamp;
+    int64_t starting_block;     // Data region relative, files only
+    int64_t ending_block;
+    int64_t length;
+    uint32_t pos;               // Index position, as counted by name_hash_slot
+    uint8_t type;               // DIRECTORY_ENTRY or FILE_ENTRY
+    uint8_t unused[3];
+    char name[56];              // NUL terminated
+};
+
+struct sfs_list_entries {
+    uint32_t cursor;
+    uint32_t count;
+    uint64_t entries;           // struct sfs_entry_info *
+};
+
+#define SFS_IOC_MAGIC           'S'
+#define SFS_IOC_LIST_ENTRIES    _IOWR(SFS_IOC_MAGIC, 1, struct sfs_list_entries)
+
+// Pick up entries appended to the image since it was mounted, as a remount
+// with the refresh option does. Needs CAP_SYS_ADMIN.
+#define SFS_IOC_REFRESH         _IO(SFS_IOC_MAGIC, 2)
+
 #endif	/* SFS_H */
 
@@ -15,22 +15,145 @@
 #include <linux/slab.h>
 #include <linux/buffer_head.h>
 #include <linux/statfs.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include <linux/jhash.h>
+#include <linux/mutex.h>
+#include <linux/shrinker.h>
+#include <linux/bsearch.h>
+#include <linux/writeback.h>
+#include <linux/memcontrol.h>
 
 #include "sfs.h"
 
+// Index and name caches are charged to the memory cgroup of the task
+// that loads them, where the kernel supports it. They are allocated with
+// index_lock held, so reclaim mustn't reenter the filesystem and evict
+// inodes, which write back their access times.
+#ifdef __GFP_ACCOUNT
+#define SFS_GFP_CACHE   (GFP_NOFS | __GFP_ACCOUNT)
+#else
+#define SFS_GFP_CACHE   GFP_NOFS
+#endif
+
+// Default cap on the memory all preloaded files of a mount may use
+#define SFS_PRELOAD_TOTAL   (16 << 20)
+
 extern const struct inode_operations sfs_inode_operations;
 extern const struct file_operations sfs_dir_operations;
 extern const struct file_operations sfs_file_operations;
 extern const struct super_operations sfs_super_ops;
+extern const struct dentry_operations sfs_dentry_operations;
+
+/**
+ * A file preloaded at mount. Its data is at offset in preload_data.
+ */
+struct sfs_preload {
+	long long starting_block;
+	unsigned int length;
+	unsigned int offset;
+};
+
+/**
+ * Options given at mount or remount.
+ */
+struct sfs_mount_opts {
+	unsigned int preload_max;
+	unsigned int preload_total;
+	int refresh;		// Remount only
+};
+
+/**
+ * Per mount state. The on-disk superblock comes first so SFS_SB() can
+ * hand it out directly.
+ */
+struct sfs_sb_info {
+	superblock s;
+	struct mutex index_lock;	// Protects the caches below
+	unsigned char *index_region;
+	unsigned long *bloom;
+	unsigned int bloom_bits;	// Power of two
+	unsigned long index_used;	// jiffies at the last index access
+	struct shrinker shrinker;
+	int shrinker_registered;
+#ifdef CONFIG_MEMCG
+	struct mem_cgroup *memcg;	// Charged for the caches, referenced
+#endif
+	unsigned int preload_max;	// Largest file to preload, 0 for none
+	unsigned int preload_total;	// Most bytes to preload in all
+	struct sfs_preload *preload;	// Sorted by starting_block
+	unsigned int preload_count;
+	char *preload_data;
+	unsigned long generation;	// Bumped when the index is refreshed
+};
+
+// Set on a data block's buffer once its checksum has been verified
+enum sfs_state_bits {
+	BH_Verified = BH_PrivateStart,
+};
+
+BUFFER_FNS(Verified, verified)
+
+/**
+ * Per inode state. pos locates the inode's index entry, counting back from
+ * the end of the media, and entry is a copy of it taken at lookup. The
+ * root inode has no entry and a pos of 0.
+ */
+struct sfs_inode_info {
+	uint32_t pos;
+	struct index_entry entry;
+	struct inode vfs_inode;
+};
 
 struct inode *sfs_get_inode(struct super_block *sb, umode_t mode);
 unsigned char *get_index_region(struct super_block *sb);
-index_entry *get_entry_by_name(struct super_block *sb, const unsigned char *name);
+void put_index_region(struct super_block *sb);
+int sfs_register_shrinker(struct super_block *sb);
+void sfs_cache_set_memcg(struct sfs_sb_info *sbi);
+void sfs_cache_put_memcg(struct sfs_sb_info *sbi);
+int sfs_parse_options(char *options, struct super_block *sb, struct sfs_mount_opts *opts);
+int sfs_verify_block(struct super_block *sb, struct buffer_head *bh, sector_t data_block);
+void sfs_preload_build(struct super_block *sb);
+const char *sfs_preload_find(struct super_block *sb, struct index_entry *entry);
+void sfs_preload_free(struct sfs_sb_info *sbi);
+int sfs_init_inodecache(void);
+void sfs_destroy_inodecache(void);
+long sfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+int get_entry_by_name(struct super_block *sb, const unsigned char *name,
+        struct index_entry *found, uint32_t *pos);
+int sfs_read_entry(struct super_block *sb, uint32_t pos, struct index_entry *found);
+int sfs_hash_lookup(struct super_block *sb, const unsigned char *name,
+        struct index_entry *found, uint32_t *pos);
+void sfs_bloom_build(struct super_block *sb);
+void sfs_bloom_add(struct super_block *sb, unsigned int count);
+int sfs_read_bytes(struct super_block *sb, long long offset, long long len, void *dest);
+int sfs_refresh_index(struct super_block *sb);
+int sfs_bloom_may_contain(struct super_block *sb, const unsigned char *name);
 
-static inline struct superblock *SFS_SB(struct super_block *sb)
+static inline struct sfs_sb_info *SFS_INFO(struct super_block *sb)
 {
 	return sb->s_fs_info;
 }
 
+static inline struct superblock *SFS_SB(struct super_block *sb)
+{
+	return &SFS_INFO(sb)->s;
+}
+
+static inline struct sfs_inode_info *SFS_I(struct inode *inode)
+{
+	return container_of(inode, struct sfs_inode_info, vfs_inode);
+}
+
+/**
+ * The name hash is only trusted if it was built against the index as it
+ * is now. Anything appended since then is only visible to an index scan.
+ */
+static inline int sfs_has_name_hash(superblock *s)
+{
+	return (s->features & SFS_FEATURE_NAME_HASH) &&
+		s->hash_index_bytes == s->index_bytes;
+}
+
 #endif
 
@@ -0,0 +1,43 @@
+#include <linux/crc32c.h>
+
+#include "../common/sfs_kern.h"
+
+/**
+ * sfs_verify_block checks a data block against the checksum table that
+ * mksfs -C writes into the reserved blocks. A block that passes is flagged
+ * on its buffer head, so it's only checked again once the page cache has
+ * dropped it and it has been read back from the device.
+ * Returns 0 if the block is good or isn't covered by the table, -EIO if
+ * it doesn't match.
+ */
+int sfs_verify_block(struct super_block *sb, struct buffer_head *bh, sector_t data_block)
+{
+    superblock *s = SFS_SB(sb);
+    uint32_t bytes_per_block = 1 << (s->block_size + 7);
+    uint32_t sums_per_block = bytes_per_block / sizeof(uint32_t);
+    struct buffer_head *csum_bh;
+    uint32_t expected, actual;
+
+    if (!(s->features & SFS_FEATURE_CHECKSUMS) || buffer_verified(bh)) {
+        return 0;
+    }
+
+    if (data_block >= s->data_blocks) {
+        return 0;
+    }
+
+    csum_bh = sb_bread(sb, s->csum_block + (data_block / sums_per_block));
+    if (csum_bh == NULL) {
+        return -EIO;
+    }
+    expected = ((uint32_t *)csum_bh->b_data)[data_block % sums_per_block];
+    brelse(csum_bh);
+
+    actual = crc32c(~0U, bh->b_data, bytes_per_block);
+    if (actual != expected) {
+        return -EIO;
+    }
+
+    set_buffer_verified(bh);
+    return 0;
+}
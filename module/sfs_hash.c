@@ -0,0 +1,186 @@
+#include "../common/sfs_kern.h"
+
+/**
+ * sfs_hash_lookup resolves a name through the on-disk name hash table that
+ * mksfs -H writes into the reserved blocks. A lookup costs one read for the
+ * bucket (two if the probe run crosses a block) plus one for the entry, and
+ * never needs the index to be loaded.
+ * Returns 0 and fills found on success, -ENOENT if the name isn't present,
+ * or -EIO if a block couldn't be read.
+ */
+int sfs_hash_lookup(struct super_block *sb, const unsigned char *name,
+        struct index_entry *found, uint32_t *pos)
+{
+    superblock *s = SFS_SB(sb);
+    uint32_t bytes_per_block = 1 << (s->block_size + 7);
+    uint32_t slots_per_block = bytes_per_block / NAME_HASH_SLOT_SIZE;
+    uint32_t mask = s->hash_slots - 1;
+    uint32_t hash = sfs_name_hash((const char *)name);
+    uint32_t slot = hash & mask;
+    uint32_t probes;
+    struct buffer_head *bh = NULL;
+    sector_t bh_block = 0;
+    name_hash_slot *hslot;
+    char *found_name;
+    int err = -ENOENT;
+
+    for (probes = 0; probes < s->hash_slots; probes++, slot = (slot + 1) & mask) {
+        sector_t block = s->hash_block + (slot / slots_per_block);
+
+        if (bh == NULL || block != bh_block) {
+            brelse(bh);
+            bh = sb_bread(sb, block);
+            if (bh == NULL) {
+                return -EIO;
+            }
+            bh_block = block;
+        }
+
+        hslot = (name_hash_slot *)bh->b_data + (slot % slots_per_block);
+        if (hslot->entry == 0) {
+            break;
+        }
+
+        if (hslot->hash != hash) {
+            continue;
+        }
+
+        err = sfs_read_entry(sb, hslot->entry, found);
+        if (err) {
+            break;
+        }
+
+        found_name = sfs_entry_name(found);
+        if (found_name != NULL && strcmp(found_name, (const char *)name) == 0) {
+            if (pos != NULL) {
+                *pos = hslot->entry;
+            }
+            break;
+        }
+        err = -ENOENT;
+    }
+
+    brelse(bh);
+    return err;
+}
+
+// Bits per name and probes per lookup. Ten bits and four probes keeps the
+// false positive rate near one percent.
+#define SFS_BLOOM_BITS_PER_NAME 10
+#define SFS_BLOOM_PROBES        4
+
+/**
+ * Both Bloom hashes come from independent functions, and the probes are
+ * spread with double hashing.
+ */
+static inline uint32_t sfs_bloom_bit(uint32_t h1, uint32_t h2, int probe, unsigned int bits)
+{
+    return (h1 + (probe * h2)) & (bits - 1);
+}
+
+static void sfs_bloom_set(unsigned long *bloom, unsigned int bits, const char *name)
+{
+    uint32_t h1 = sfs_name_hash(name);
+    uint32_t h2 = jhash(name, strlen(name), 0) | 1;
+    int probe;
+
+    for (probe = 0; probe < SFS_BLOOM_PROBES; probe++) {
+        set_bit(sfs_bloom_bit(h1, h2, probe, bits), bloom);
+    }
+}
+
+/**
+ * sfs_bloom_build fills the mount's Bloom filter with every name in the
+ * cached index. It's called, with index_lock held, whenever the index is
+ * loaded. If the filter can't be allocated lookups simply go without it.
+ */
+void sfs_bloom_build(struct super_block *sb)
+{
+    struct sfs_sb_info *sbi = SFS_INFO(sb);
+    unsigned int entries = sbi->s.index_bytes / INDEX_ENTRY_SIZE;
+    unsigned int bits = roundup_pow_of_two(max(entries * SFS_BLOOM_BITS_PER_NAME, 64U));
+    struct index_entry *ientry;
+    unsigned long *bloom;
+    unsigned int i;
+    char *name;
+
+    if (sbi->bloom != NULL) {
+        return;
+    }
+
+    bloom = __vmalloc(BITS_TO_LONGS(bits) * sizeof(unsigned long),
+            SFS_GFP_CACHE | __GFP_ZERO | __GFP_HIGHMEM, PAGE_KERNEL);
+    if (bloom == NULL) {
+        printk(KERN_WARNING "SFS: No memory for a %u bit name filter\n", bits);
+        return;
+    }
+
+    for (i = 0; i < entries; i++) {
+        ientry = (struct index_entry *)(sbi->index_region + (i * INDEX_ENTRY_SIZE));
+        name = sfs_entry_name(ientry);
+        if (name != NULL) {
+            sfs_bloom_set(bloom, bits, name);
+        }
+    }
+
+    sbi->bloom_bits = bits;
+    sbi->bloom = bloom;
+}
+
+/**
+ * sfs_bloom_add puts the names of the first count entries of the cached
+ * index, the ones just added to it, into the filter. Once the filter holds
+ * twice the names it was sized for it's rebuilt at the new size instead.
+ * The caller holds index_lock.
+ */
+void sfs_bloom_add(struct super_block *sb, unsigned int count)
+{
+    struct sfs_sb_info *sbi = SFS_INFO(sb);
+    unsigned int entries = sbi->s.index_bytes / INDEX_ENTRY_SIZE;
+    unsigned int i;
+    char *name;
+
+    if (sbi->bloom == NULL) {
+        return;
+    }
+
+    if (entries * SFS_BLOOM_BITS_PER_NAME > sbi->bloom_bits * 2) {
+        vfree(sbi->bloom);
+        sbi->bloom = NULL;
+        sbi->bloom_bits = 0;
+        sfs_bloom_build(sb);
+        return;
+    }
+
+    for (i = 0; i < count && i < entries; i++) {
+        name = sfs_entry_name((struct index_entry *)(sbi->index_region + (i * INDEX_ENTRY_SIZE)));
+        if (name != NULL) {
+            sfs_bloom_set(sbi->bloom, sbi->bloom_bits, name);
+        }
+    }
+}
+
+/**
+ * Returns 0 only if name is definitely not in the index. Without a filter
+ * every name may be present. The caller holds index_lock.
+ */
+int sfs_bloom_may_contain(struct super_block *sb, const unsigned char *name)
+{
+    struct sfs_sb_info *sbi = SFS_INFO(sb);
+    uint32_t h1, h2;
+    int probe;
+
+    if (sbi->bloom == NULL) {
+        return 1;
+    }
+
+    h1 = sfs_name_hash((const char *)name);
+    h2 = jhash(name, strlen(name), 0) | 1;
+    for (probe = 0; probe < SFS_BLOOM_PROBES; probe++) {
+        if (!test_bit(sfs_bloom_bit(h1, h2, probe, sbi->bloom_bits), sbi->bloom)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
@@ -2,32 +2,101 @@
 // http://www2.comp.ufscar.br/~helio/fs/rkfs.html
 // http://www.ccs-labs.org/teaching/os/2014w/exercise-09.pdf
 
+#include <linux/parser.h>
+
 #include "../common/sfs_kern.h"
 
+enum {
+    Opt_preload, Opt_preload_size, Opt_preload_total, Opt_refresh, Opt_err
+};
+
+static const match_table_t sfs_tokens = {
+    {Opt_preload, "preload"},
+    {Opt_preload_size, "preload=%u"},
+    {Opt_preload_total, "preload_total=%u"},
+    {Opt_refresh, "refresh"},
+    {Opt_err, NULL}
+};
+
+/**
+ * Parse the mount options into opts, leaving anything not given as it was.
+ * preload keeps every file of up to one block in memory from mount time
+ * on, preload=<bytes> sets a different limit and preload_total=<bytes>
+ * caps the memory used by all of them. refresh asks a remount to pick up
+ * entries appended to the image.
+ */
+int sfs_parse_options(char *options, struct super_block *sb, struct sfs_mount_opts *opts)
+{
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
+    int size;
+
+    if (options == NULL) {
+        return 0;
+    }
+
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (*p == '\0') {
+            continue;
+        }
+
+        switch (match_token(p, sfs_tokens, args)) {
+            case Opt_preload:
+                opts->preload_max = 1 << (SFS_SB(sb)->block_size + 7);
+                break;
+            case Opt_preload_size:
+                if (match_int(&args[0], &size) || size < 0) {
+                    return -EINVAL;
+                }
+                opts->preload_max = size;
+                break;
+            case Opt_preload_total:
+                if (match_int(&args[0], &size) || size < 0) {
+                    return -EINVAL;
+                }
+                opts->preload_total = size;
+                break;
+            case Opt_refresh:
+                opts->refresh = 1;
+                break;
+            default:
+                printk(KERN_ERR "SFS: Unknown mount option %s\n", p);
+                return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
 /**
  * Fill super is the callback for the generic mount_bdev(). This will
  * be called on filesystem registration.
  */
 static int sfs_fill_super(struct super_block *sb, void *data, int silent) {
+    struct sfs_sb_info *sbi;
     superblock *sfs_sb;
     struct buffer_head *bh;
     struct inode *root = NULL;
+    struct sfs_mount_opts opts = { .preload_total = SFS_PRELOAD_TOTAL };
 
-    // Allocate our SFS superblock
-    sfs_sb = kzalloc(sizeof (superblock), GFP_KERNEL);
-    if (!sfs_sb) {
+    // Allocate our per mount state, which holds the SFS superblock
+    sbi = kzalloc(sizeof (struct sfs_sb_info), GFP_KERNEL);
+    if (!sbi) {
         return -ENOMEM;
     }
+    sfs_sb = &sbi->s;
+    mutex_init(&sbi->index_lock);
 
-    sb->s_fs_info = sfs_sb;
+    sb->s_fs_info = sbi;
     sb->s_magic = SFS_MAGIC_NUMBER;
     sb->s_op = &sfs_super_ops;
+    sb->s_d_op = &sfs_dentry_operations;
 
     // 512 is a hardcoded value here. This is configurable in the
     // filesystem however.
     if (!sb_set_blocksize(sb, 512)) {
         printk(KERN_ERR "device does not support %d byte blocks\n", 512);
-        kfree(sfs_sb);
+        kfree(sbi);
         return -EINVAL;
     }
 
@@ -36,14 +105,41 @@ static int sfs_fill_super(struct super_block *sb, void *data, int silent) {
     
     memcpy(sfs_sb, bh->b_data + SUPERBLOCK_OFFSET, sizeof(superblock));
     if (sfs_sb->version != SFS_MAGIC_NUMBER) {
-        kfree(sfs_sb);
+        kfree(sbi);
         printk(KERN_ERR "Invalid magic in superblock: %x\n", sfs_sb->version);
         return -EINVAL;
     }
 
+    // Only member 0 of a volume set has an index, and its files are
+    // striped across images the module can't see.
+    if (sfs_sb->features & SFS_FEATURE_VOLUME_SET) {
+        kfree(sbi);
+        printk(KERN_ERR "SFS: Volume set images can only be read with the userspace tools\n");
+        return -EINVAL;
+    }
+
+    if ((sfs_sb->features & SFS_FEATURE_NAME_HASH) &&
+            (sfs_sb->hash_slots == 0 || !is_power_of_2(sfs_sb->hash_slots))) {
+        printk(KERN_WARNING "SFS: Ignoring name hash with %u slots\n", sfs_sb->hash_slots);
+        sfs_sb->features &= ~SFS_FEATURE_NAME_HASH;
+    }
+
+    if ((sfs_sb->features & SFS_FEATURE_CHECKSUMS) &&
+            (sfs_sb->csum_block == 0 || sfs_sb->csum_block >= sfs_sb->reserved_blocks)) {
+        printk(KERN_WARNING "SFS: Ignoring checksum table at block %lld\n", sfs_sb->csum_block);
+        sfs_sb->features &= ~SFS_FEATURE_CHECKSUMS;
+    }
+
+    if (sfs_parse_options(data, sb, &opts)) {
+        kfree(sbi);
+        return -EINVAL;
+    }
+    sbi->preload_max = opts.preload_max;
+    sbi->preload_total = opts.preload_total;
+
     root = sfs_get_inode(sb, S_IFDIR | 0755);
     if (!root) {
-        kfree(sfs_sb);
+        kfree(sbi);
         printk(KERN_ERR "inode allocation failed\n");
         return -ENOMEM;
     }
@@ -53,11 +149,18 @@ static int sfs_fill_super(struct super_block *sb, void *data, int silent) {
 
     sb->s_root = d_make_root(root);
     if (!sb->s_root) {
-        kfree(sfs_sb);
+        kfree(sbi);
         printk(KERN_ERR "root creation failed\n");
         return -ENOMEM;
     }
 
+    // Without a shrinker the caches simply stay until unmount.
+    if (sfs_register_shrinker(sb)) {
+        printk(KERN_WARNING "SFS: Could not register cache shrinker\n");
+    }
+
+    sfs_preload_build(sb);
+
     return 0;
 }
 
@@ -97,9 +200,16 @@ static struct file_system_type sfs_fs_type = {
 int init_module(void) {
     int err;
 
+    err = sfs_init_inodecache();
+    if (err) {
+        printk(KERN_ERR "SFS: Error creating inode cache\n");
+        return err;
+    }
+
     err = register_filesystem(&sfs_fs_type);
     if (err) {
         printk(KERN_ERR "SFS: Error registering filesystem\n");
+        sfs_destroy_inodecache();
         return err;
     }
 
@@ -109,8 +219,10 @@ int init_module(void) {
 
 void cleanup_module(void) {
     unregister_filesystem(&sfs_fs_type);
+    sfs_destroy_inodecache();
 
     printk(KERN_INFO "SFS Filesystem removed\n");
 }
 
 MODULE_LICENSE("GPL");
+MODULE_SOFTDEP("pre: crc32c");
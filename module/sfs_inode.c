@@ -27,7 +27,7 @@ static void milli_to_timespec(unsigned long long ms, struct timespec *ts)
 /**
  * When an inode is first looked up, this function is called. The index
  * is searched for a matching entry, and an inode is created for that
- * entry.
+ * entry. Names that don't exist are cached as negative dentries.
  * @param dir Parent inode
  * @param entry Child entry
  * @param flags
@@ -35,54 +35,56 @@ static void milli_to_timespec(unsigned long long ms, struct timespec *ts)
  */
 static struct dentry *sfs_inode_lookup(struct inode *dir, struct dentry *entry, unsigned int flags)
 {
-    uint8_t i;
-    unsigned char *index_region;
     struct inode *new_inode=NULL;
-    struct index_entry *ientry;
+    struct index_entry ientry;
+    unsigned long gen;
+    uint32_t pos;
+    int err;
 
-    index_region = get_index_region(dir->i_sb);
-    if (index_region==NULL) {
-        printk(KERN_ERR "SFS: Could not find index region\n");
-        return 0;
-    }
+    // The generation is taken before the lookup. A refresh that lands
+    // after it leaves a miss with the old generation, to be looked up again.
+    gen = ACCESS_ONCE(SFS_INFO(dir->i_sb)->generation);
+    smp_rmb();
 
     // Find a matching entry in our index. Populate as much info as we can
     // about that entry. SFS doesn't have support for permissons in the
     // spec, so we are rather limited.
-    for (i=0; i<(SFS_SB(dir->i_sb)->index_bytes / INDEX_ENTRY_SIZE)+1;i++) {
-        ientry = (struct index_entry *)(index_region + (i * INDEX_ENTRY_SIZE));
-
-        if (ientry->type == DIRECTORY_ENTRY) {
-            if (strcmp(ientry->dir.dir_name, entry->d_name.name)==0) {
-                new_inode = sfs_get_inode(dir->i_sb, S_IFDIR | 0755);
-                milli_to_timespec(ientry->dir.timestamp, &new_inode->i_mtime);
-                milli_to_timespec(ientry->dir.timestamp, &new_inode->i_ctime);
-                break;
-            }
-        }
+    err = get_entry_by_name(dir->i_sb, entry->d_name.name, &ientry, &pos);
+    if (err && err != -ENOENT) {
+        return ERR_PTR(err);
+    }
 
-        if (ientry->type == FILE_ENTRY) {
-            if (strcmp(ientry->file.file_name, entry->d_name.name)==0) {
-                new_inode = sfs_get_inode(dir->i_sb, S_IFREG | 0644);
-                new_inode->i_size = ientry->file.length;
-                milli_to_timespec(ientry->file.timestamp, &new_inode->i_mtime);
-                milli_to_timespec(ientry->file.timestamp, &new_inode->i_ctime);
-                break;
-            }
+    if (err == 0 && ientry.type == DIRECTORY_ENTRY) {
+        new_inode = sfs_get_inode(dir->i_sb, S_IFDIR | 0755);
+        if (new_inode != NULL) {
+            milli_to_timespec(ientry.dir.timestamp, &new_inode->i_mtime);
         }
-
-        if (ientry->type == VOLUME_ID_ENTRY) {
-            break;
+    } else if (err == 0 && ientry.type == FILE_ENTRY) {
+        new_inode = sfs_get_inode(dir->i_sb, S_IFREG | 0644);
+        if (new_inode != NULL) {
+            new_inode->i_size = ientry.file.length;
+            milli_to_timespec(ientry.file.timestamp, &new_inode->i_mtime);
         }
     }
 
-    if (new_inode==NULL) {
-        printk(KERN_ERR "SFS: Could not find entry for %s\n", entry->d_name.name);
-    } else {
-        new_inode->i_atime = CURRENT_TIME;
-        d_add(entry, new_inode);
+    if (err == 0 && new_inode==NULL) {
+        return ERR_PTR(-ENOMEM);
     }
 
+    // SFS keeps a single timestamp per entry, and it stands in for all
+    // three times. Any access time update is written back into it.
+    if (new_inode!=NULL) {
+        new_inode->i_atime = new_inode->i_ctime = new_inode->i_mtime;
+        SFS_I(new_inode)->pos = pos;
+        SFS_I(new_inode)->entry = ientry;
+    }
+
+    // A miss still gets a dentry. Adding it without an inode leaves a
+    // negative dentry behind, so probing for the same missing name again
+    // is answered by the dcache, at least until the index is refreshed.
+    entry->d_time = gen;
+    d_add(entry, new_inode);
+
     return NULL;
 }
 
@@ -120,3 +122,21 @@ struct inode *sfs_get_inode(struct super_block *sb, umode_t mode)
 const struct inode_operations sfs_inode_operations = {
     .lookup = sfs_inode_lookup,
 };
+
+/**
+ * Negative dentries from before an index refresh may name entries that
+ * have since been appended, so they're looked up again. Positive dentries
+ * stay valid, appending never moves an existing entry.
+ */
+static int sfs_d_revalidate(struct dentry *dentry, unsigned int flags)
+{
+    if (d_inode(dentry) != NULL) {
+        return 1;
+    }
+
+    return dentry->d_time == ACCESS_ONCE(SFS_INFO(dentry->d_sb)->generation);
+}
+
+const struct dentry_operations sfs_dentry_operations = {
+    .d_revalidate = sfs_d_revalidate,
+};
@@ -0,0 +1,148 @@
+#include <linux/uaccess.h>
+#include <linux/capability.h>
+
+#include "../common/sfs_kern.h"
+
+// Entries staged per trip through the index lock. Copying out to userspace
+// happens with the lock dropped, since it may fault.
+#define SFS_LIST_BATCH 128
+
+/**
+ * Fill out with up to max directory and file entries past *cursor, reading
+ * the cached index under its lock. Positions only ever grow as entries are
+ * added, so *cursor stays valid even if the index is dropped and reloaded
+ * between calls.
+ * Returns the number of entries filled in, or a negative error.
+ */
+static int sfs_list_batch(struct super_block *sb, uint32_t *cursor,
+        struct sfs_entry_info *out, unsigned int max)
+{
+    superblock *s = SFS_SB(sb);
+    unsigned char *index_region;
+    struct index_entry *ientry;
+    struct sfs_entry_info *info;
+    uint32_t entries, pos;
+    unsigned int filled = 0;
+
+    index_region = get_index_region(sb);
+    if (index_region == NULL) {
+        return -ENOMEM;
+    }
+
+    entries = s->index_bytes / INDEX_ENTRY_SIZE;
+    for (pos = *cursor + 1; pos <= entries && filled < max; pos++) {
+        ientry = (struct index_entry *)(index_region + s->index_bytes - ((long long)pos * INDEX_ENTRY_SIZE));
+        if (ientry->type != DIRECTORY_ENTRY && ientry->type != FILE_ENTRY) {
+            continue;
+        }
+
+        info = &out[filled++];
+        memset(info, 0, sizeof(*info));
+        info->pos = pos;
+        info->type = ientry->type;
+        if (ientry->type == DIRECTORY_ENTRY) {
+            info->timestamp = ientry->dir.timestamp;
+            memcpy(info->name, ientry->dir.dir_name,
+                    strnlen(ientry->dir.dir_name, sizeof(ientry->dir.dir_name)));
+        } else {
+            info->timestamp = ientry->file.timestamp;
+            info->starting_block = ientry->file.starting_block;
+            info->ending_block = ientry->file.ending_block;
+            info->length = ientry->file.length;
+            memcpy(info->name, ientry->file.file_name,
+                    strnlen(ientry->file.file_name, sizeof(ientry->file.file_name)));
+        }
+    }
+    // The lowest slot is the starting marker, and the next entry appended
+    // goes into it. Stopping short of it lets a later call pick that up.
+    *cursor = min_t(uint32_t, pos - 1, entries - 1);
+
+    put_index_region(sb);
+    return filled;
+}
+
+/**
+ * Copy out every live entry in caller sized batches. This serves
+ * inventories of the whole filesystem without a lookup, an inode or a
+ * dentry per file.
+ */
+static long sfs_ioc_list_entries(struct file *filp, struct sfs_list_entries __user *uarg)
+{
+    struct super_block *sb = file_inode(filp)->i_sb;
+    struct sfs_list_entries req;
+    struct sfs_entry_info *batch;
+    struct sfs_entry_info __user *dest;
+    unsigned int done = 0;
+    uint32_t cursor;
+    long err = 0;
+    int n;
+
+    if (copy_from_user(&req, uarg, sizeof(req))) {
+        return -EFAULT;
+    }
+    dest = (struct sfs_entry_info __user *)(uintptr_t)req.entries;
+
+    batch = kmalloc_array(SFS_LIST_BATCH, sizeof(*batch), GFP_KERNEL);
+    if (batch == NULL) {
+        return -ENOMEM;
+    }
+
+    while (done < req.count) {
+        cursor = req.cursor;
+        n = sfs_list_batch(sb, &cursor, batch, min_t(unsigned int, req.count - done, SFS_LIST_BATCH));
+        if (n <= 0) {
+            err = n;
+            break;
+        }
+
+        if (copy_to_user(dest + done, batch, n * sizeof(*batch))) {
+            err = -EFAULT;
+            break;
+        }
+        done += n;
+        req.cursor = cursor;
+
+        if (fatal_signal_pending(current)) {
+            break;
+        }
+        cond_resched();
+    }
+    kfree(batch);
+
+    // Entries already copied out are reported even if a later batch failed,
+    // so the caller can resume from the returned cursor.
+    if (err && done == 0) {
+        return err;
+    }
+
+    req.count = done;
+    if (copy_to_user(uarg, &req, sizeof(req))) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+long sfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct inode *inode = file_inode(filp);
+
+    switch (cmd) {
+    case SFS_IOC_LIST_ENTRIES:
+        if (inode != inode->i_sb->s_root->d_inode) {
+            return -ENOTTY;
+        }
+        return sfs_ioc_list_entries(filp, (struct sfs_list_entries __user *)arg);
+    case SFS_IOC_REFRESH:
+        if (inode != inode->i_sb->s_root->d_inode) {
+            return -ENOTTY;
+        }
+        // Rereading the index is device I/O on behalf of every user of
+        // the mount, so it's left to whoever could remount it.
+        if (!capable(CAP_SYS_ADMIN)) {
+            return -EPERM;
+        }
+        return sfs_refresh_index(inode->i_sb);
+    default:
+        return -ENOTTY;
+    }
+}
@@ -0,0 +1,183 @@
+#include <linux/sort.h>
+#include <linux/blkdev.h>
+
+#include "../common/sfs_kern.h"
+
+/*
+ * Small file preloading, enabled with the preload mount option. At mount
+ * every file no larger than the threshold is read with one batched
+ * readahead over all of their extents and packed into a single buffer.
+ * Reads of those files are then served from memory with no block I/O.
+ * Files sharing an extent share the copy.
+ */
+
+static int sfs_preload_cmp(const void *a, const void *b)
+{
+    const struct sfs_preload *x = a, *y = b;
+
+    if (x->starting_block != y->starting_block) {
+        return x->starting_block < y->starting_block ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Copy one preloaded file out of the buffer cache into the blob, verifying
+ * each block on the way if the image has checksums.
+ */
+static int sfs_preload_copy(struct super_block *sb, struct sfs_preload *p, char *dest)
+{
+    superblock *s = SFS_SB(sb);
+    uint32_t bytes_per_block = 1 << (s->block_size + 7);
+    struct buffer_head *bh;
+    unsigned int copied = 0, chunk;
+    sector_t block = p->starting_block;
+    int err;
+
+    while (copied < p->length) {
+        bh = sb_bread(sb, block + s->reserved_blocks);
+        if (bh == NULL) {
+            return -EIO;
+        }
+
+        err = sfs_verify_block(sb, bh, block);
+        if (err) {
+            brelse(bh);
+            return err;
+        }
+
+        chunk = min(p->length - copied, bytes_per_block);
+        memcpy(dest + copied, bh->b_data, chunk);
+        brelse(bh);
+
+        copied += chunk;
+        block++;
+    }
+
+    return 0;
+}
+
+/**
+ * sfs_preload_build gathers every file up to preload_max bytes from the
+ * index, until preload_total bytes are used. Files that don't fit, and
+ * failures to preload, aren't fatal, those files are simply read from the
+ * device as usual.
+ */
+void sfs_preload_build(struct super_block *sb)
+{
+    struct sfs_sb_info *sbi = SFS_INFO(sb);
+    superblock *s = SFS_SB(sb);
+    uint32_t bytes_per_block = 1 << (s->block_size + 7);
+    unsigned int entries = s->index_bytes / INDEX_ENTRY_SIZE;
+    struct sfs_preload *files;
+    struct index_entry *ientry;
+    struct blk_plug plug;
+    unsigned char *index_region;
+    unsigned int i, count = 0, kept = 0;
+    unsigned long total = 0;
+    sector_t block, last;
+    char *blob;
+
+    if (sbi->preload_max == 0) {
+        return;
+    }
+
+    files = vmalloc(entries * sizeof(struct sfs_preload));
+    if (files == NULL) {
+        return;
+    }
+
+    index_region = get_index_region(sb);
+    if (index_region == NULL) {
+        vfree(files);
+        return;
+    }
+
+    for (i = 0; i < entries; i++) {
+        ientry = (struct index_entry *)(index_region + (i * INDEX_ENTRY_SIZE));
+        if (ientry->type != FILE_ENTRY || ientry->file.length <= 0 ||
+                ientry->file.length > sbi->preload_max || ientry->file.starting_block < 0) {
+            continue;
+        }
+
+        files[count].starting_block = ientry->file.starting_block;
+        files[count].length = ientry->file.length;
+        count++;
+    }
+    put_index_region(sb);
+
+    // Sorting by block makes the readahead one sweep across the device,
+    // and brings files that share an extent next to each other.
+    sort(files, count, sizeof(struct sfs_preload), sfs_preload_cmp, NULL);
+    for (i = 0; i < count; i++) {
+        if (kept > 0 && files[kept - 1].starting_block == files[i].starting_block) {
+            continue;
+        }
+        if (total + files[i].length > sbi->preload_total) {
+            continue;
+        }
+        files[kept] = files[i];
+        files[kept].offset = total;
+        total += files[i].length;
+        kept++;
+    }
+
+    blob = vmalloc(total ? total : 1);
+    if (blob == NULL) {
+        printk(KERN_WARNING "SFS: No memory to preload %lu bytes\n", total);
+        vfree(files);
+        return;
+    }
+
+    blk_start_plug(&plug);
+    for (i = 0; i < kept; i++) {
+        last = files[i].starting_block + DIV_ROUND_UP(files[i].length, bytes_per_block);
+        for (block = files[i].starting_block; block < last; block++) {
+            sb_breadahead(sb, block + s->reserved_blocks);
+        }
+    }
+    blk_finish_plug(&plug);
+
+    for (i = 0; i < kept; i++) {
+        if (sfs_preload_copy(sb, &files[i], blob + files[i].offset)) {
+            // Leave it to be read, and fail, the normal way
+            files[i].length = 0;
+        }
+    }
+
+    sbi->preload = files;
+    sbi->preload_count = kept;
+    sbi->preload_data = blob;
+
+    printk(KERN_INFO "SFS: Preloaded %u files, %lu bytes\n", kept, total);
+}
+
+/**
+ * Return the preloaded copy of a file, or NULL if it wasn't preloaded.
+ */
+const char *sfs_preload_find(struct super_block *sb, struct index_entry *entry)
+{
+    struct sfs_sb_info *sbi = SFS_INFO(sb);
+    struct sfs_preload key, *p;
+
+    if (sbi->preload_count == 0 || entry->file.length > sbi->preload_max) {
+        return NULL;
+    }
+
+    key.starting_block = entry->file.starting_block;
+    p = bsearch(&key, sbi->preload, sbi->preload_count, sizeof(struct sfs_preload), sfs_preload_cmp);
+    if (p == NULL || p->length != entry->file.length) {
+        return NULL;
+    }
+
+    return sbi->preload_data + p->offset;
+}
+
+void sfs_preload_free(struct sfs_sb_info *sbi)
+{
+    vfree(sbi->preload);
+    vfree(sbi->preload_data);
+    sbi->preload = NULL;
+    sbi->preload_data = NULL;
+    sbi->preload_count = 0;
+}
@@ -0,0 +1,201 @@
+#include <linux/version.h>
+
+#include "../common/sfs_kern.h"
+
+/*
+ * Images can be appended to while they're mounted read only elsewhere.
+ * Appending only ever adds entries at the low end of the index and data
+ * past the starting marker's next block, so a refresh reads just those
+ * blocks and splices them into what's cached, rather than a remount
+ * dropping every inode, dentry and the index.
+ */
+
+/**
+ * Read count blocks from block on straight from the device, replacing
+ * anything the buffer cache held for them. Later sb_bread calls then see
+ * what's on the image now.
+ */
+static int sfs_reread_blocks(struct super_block *sb, sector_t block, sector_t count)
+{
+    struct buffer_head *bh;
+    sector_t i;
+
+    for (i = 0; i < count; i++) {
+        bh = sb_getblk(sb, block + i);
+        if (bh == NULL) {
+            return -ENOMEM;
+        }
+
+        // A dirty buffer holds an access time that hasn't reached the disk
+        // yet. Write it out first, so the read doesn't throw it away.
+        lock_buffer(bh);
+        while (buffer_dirty(bh)) {
+            unlock_buffer(bh);
+            sync_dirty_buffer(bh);
+            lock_buffer(bh);
+        }
+        get_bh(bh);
+        bh->b_end_io = end_buffer_read_sync;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+        submit_bh(READ, bh);
+#else
+        submit_bh(REQ_OP_READ, 0, bh);
+#endif
+        wait_on_buffer(bh);
+
+        if (!buffer_uptodate(bh)) {
+            brelse(bh);
+            return -EIO;
+        }
+        // Checksums are checked again for anything reread
+        clear_buffer_verified(bh);
+        brelse(bh);
+    }
+
+    return 0;
+}
+
+/**
+ * The byte range [start, start + len) as a run of blocks to reread.
+ */
+static int sfs_reread_bytes(struct super_block *sb, long long start, long long len)
+{
+    uint32_t bytes_per_block = 1 << (SFS_SB(sb)->block_size + 7);
+    sector_t first = start / bytes_per_block;
+    sector_t last = (start + len - 1) / bytes_per_block;
+
+    return sfs_reread_blocks(sb, first, last - first + 1);
+}
+
+/**
+ * sfs_refresh_index picks up entries appended to the image since it was
+ * mounted. The superblock is read again, and if the index has only grown
+ * the new entries are read and added to the cached index and Bloom
+ * filter. Cached inodes and positive dentries are untouched, negative
+ * dentries are looked up again.
+ * Refreshes are serialised on index_lock from the superblock read on, so
+ * a slower caller can't apply an older superblock over a newer one.
+ * Returns 0, or -ESTALE if the image changed in some other way, in which
+ * case it has to be mounted again.
+ */
+int sfs_refresh_index(struct super_block *sb)
+{
+    struct sfs_sb_info *sbi = SFS_INFO(sb);
+    superblock *s = &sbi->s;
+    superblock fresh;
+    struct buffer_head *bh;
+    uint32_t bytes_per_block = 1 << (s->block_size + 7);
+    uint32_t sums_per_block = bytes_per_block / sizeof(uint32_t);
+    long long media_size = s->total_blocks * bytes_per_block;
+    long long index_start, added, old_next = 0, new_next;
+    unsigned char *index_region;
+    int err;
+
+    mutex_lock(&sbi->index_lock);
+
+    err = sfs_reread_blocks(sb, 0, 1);
+    if (err) {
+        goto out;
+    }
+    bh = sb_bread(sb, 0);
+    if (bh == NULL) {
+        err = -EIO;
+        goto out;
+    }
+    memcpy(&fresh, bh->b_data + SUPERBLOCK_OFFSET, sizeof(superblock));
+    brelse(bh);
+
+    if (fresh.version != SFS_MAGIC_NUMBER || fresh.block_size != s->block_size ||
+            fresh.total_blocks != s->total_blocks || fresh.reserved_blocks != s->reserved_blocks ||
+            (fresh.features & SFS_FEATURE_VOLUME_SET) || fresh.index_bytes < s->index_bytes ||
+            fresh.index_bytes > media_size || fresh.index_bytes % INDEX_ENTRY_SIZE) {
+        printk(KERN_WARNING "SFS: Image has changed shape, it has to be mounted again\n");
+        err = -ESTALE;
+        goto out;
+    }
+
+    added = fresh.index_bytes - s->index_bytes;
+    index_start = media_size - fresh.index_bytes;
+    if (added > 0) {
+        // The old starting marker's slot now holds the first new entry, so
+        // it's read again along with everything below it.
+        err = sfs_reread_bytes(sb, index_start, added + INDEX_ENTRY_SIZE);
+        if (err) {
+            goto out;
+        }
+    }
+
+    // A name hash rebuilt for the new index replaces the old one in place
+    if ((s->features & SFS_FEATURE_NAME_HASH) && fresh.hash_slots == s->hash_slots &&
+            fresh.hash_block == s->hash_block && fresh.hash_index_bytes != s->hash_index_bytes) {
+        err = sfs_reread_bytes(sb, s->hash_block * bytes_per_block,
+                (long long)s->hash_slots * NAME_HASH_SLOT_SIZE);
+        if (err) {
+            goto out;
+        }
+        s->hash_index_bytes = fresh.hash_index_bytes;
+    }
+
+    if (added <= 0) {
+        goto out;
+    }
+
+    // New data went in from the old starting marker's next block on, so
+    // that's where checksums may have been added.
+    bh = sb_bread(sb, index_start / bytes_per_block);
+    if (bh == NULL) {
+        err = -EIO;
+        goto out;
+    }
+    new_next = ((struct index_entry *)(bh->b_data + (index_start % bytes_per_block)))->first_entry.next_starting_block;
+    brelse(bh);
+    if (sbi->index_region != NULL) {
+        old_next = ((struct index_entry *)sbi->index_region)->first_entry.next_starting_block;
+    }
+    if ((s->features & SFS_FEATURE_CHECKSUMS) && new_next > old_next) {
+        new_next = min_t(long long, new_next, s->data_blocks);
+        if (new_next > old_next) {
+            err = sfs_reread_blocks(sb, s->csum_block + (old_next / sums_per_block),
+                    ((new_next - 1) / sums_per_block) - (old_next / sums_per_block) + 1);
+            if (err) {
+                goto out;
+            }
+        }
+    }
+
+    // Splice the new entries in front of the cached ones. Without a cached
+    // index there's nothing to do, the next load reads the new one.
+    if (sbi->index_region != NULL) {
+        index_region = kzalloc(fresh.index_bytes, SFS_GFP_CACHE);
+        if (index_region == NULL) {
+            err = -ENOMEM;
+            goto out;
+        }
+        sfs_cache_set_memcg(sbi);
+
+        err = sfs_read_bytes(sb, index_start, added + INDEX_ENTRY_SIZE, index_region);
+        if (err) {
+            kfree(index_region);
+            goto out;
+        }
+        memcpy(index_region + added + INDEX_ENTRY_SIZE, sbi->index_region + INDEX_ENTRY_SIZE,
+                s->index_bytes - INDEX_ENTRY_SIZE);
+
+        kfree(sbi->index_region);
+        sbi->index_region = index_region;
+    }
+
+    s->index_bytes = fresh.index_bytes;
+    s->alteration_time = fresh.alteration_time;
+    sfs_bloom_add(sb, (added / INDEX_ENTRY_SIZE) + 1);
+    // Pairs with the barrier in sfs_inode_lookup: the new entries are
+    // visible to anyone who sees the new generation.
+    smp_wmb();
+    sbi->generation++;
+
+    printk(KERN_INFO "SFS: Picked up %lld new index entries\n", added / INDEX_ENTRY_SIZE);
+
+out:
+    mutex_unlock(&sbi->index_lock);
+    return err;
+}
@@ -1,79 +1,146 @@
 #include "../common/sfs_kern.h"
 
-// get_index_region will locate the blocks containing the
-// entire SFS index. Those blocks will be copied into a 
-// buffer and returned.
-static unsigned char *cached_index_region = NULL;
+/**
+ * sfs_read_bytes copies len bytes starting at byte offset on the device
+ * into dest, a block at a time. Returns 0, or -EIO if a block can't be read.
+ */
+int sfs_read_bytes(struct super_block *sb, long long offset, long long len, void *dest)
+{
+    uint32_t bytes_per_block = 1 << (SFS_SB(sb)->block_size + 7);
+    sector_t block = offset / bytes_per_block;
+    unsigned int block_offset = offset % bytes_per_block;
+    struct buffer_head *bh;
+    long long copied = 0;
+    unsigned int chunk;
+
+    while (copied < len) {
+        bh = sb_bread(sb, block);
+        if (bh==NULL) {
+            return -EIO;
+        }
+
+        // The range probably starts somewhere in the middle of the first
+        // block. Every block after that is copied from its start.
+        chunk = min_t(long long, bytes_per_block - block_offset, len - copied);
+        memcpy((char *)dest + copied, bh->b_data + block_offset, chunk);
+        brelse(bh);
+
+        copied += chunk;
+        block_offset = 0;
+        block++;
+    }
+
+    return 0;
+}
 
 /**
  * get_index_region will return the copy of the index cached in
  * memory. If the index hasn't been cached yet, the index will
- * be read and stored, then returned.
+ * be read and stored, then returned. Loading the index also builds
+ * the Bloom filter used to reject lookups of missing names.
+ * On success the index is returned locked, so the shrinker can't drop
+ * it until the caller is done with it and calls put_index_region.
  */
 unsigned char *get_index_region(struct super_block *sb)
 {
-    superblock *s = sb->s_fs_info;
-    struct buffer_head *bh;
+    struct sfs_sb_info *sbi = SFS_INFO(sb);
+    superblock *s = SFS_SB(sb);
     uint32_t bytes_per_block = 1 << (s->block_size + 7);
-    sector_t index_block = ((s->total_blocks * bytes_per_block) - s->index_bytes) / bytes_per_block;
-    unsigned int index_offset;
-    unsigned int index_blocks = (s->index_bytes / bytes_per_block) + 1;
-    uint8_t i;
+    long long index_start = (s->total_blocks * bytes_per_block) - s->index_bytes;
+
+    mutex_lock(&sbi->index_lock);
+    sbi->index_used = jiffies;
 
-    if (cached_index_region==NULL) {
-        // If we haven't created the region yet, then allocate it
-        // and load it from disk.
-        unsigned char *index_region = (char*)kzalloc(s->index_bytes, GFP_KERNEL);
-        unsigned char *ptr = index_region;
+    if (sbi->index_region==NULL) {
+        // If we haven't created the region yet, or the shrinker dropped
+        // it, then allocate it and load it from disk. The memory is charged
+        // to the cgroup of whoever brings it in.
+        unsigned char *index_region = (char*)kzalloc(s->index_bytes, SFS_GFP_CACHE);
 
         if (index_region==NULL) {
+            mutex_unlock(&sbi->index_lock);
             return NULL;
         }
 
-        if (s->index_bytes <= bytes_per_block) {
-             index_offset = bytes_per_block - s->index_bytes;
-        } else {
-             index_offset = bytes_per_block - (s->index_bytes - bytes_per_block);
+        if (sfs_read_bytes(sb, index_start, s->index_bytes, index_region)) {
+            kfree(index_region);
+            mutex_unlock(&sbi->index_lock);
+            return NULL;
         }
 
-        for (i = 0; i < index_blocks; i++) {
-            bh = sb_bread(sb, index_block + i);
-            if (i == 0) {
-                // We want to copy to the beginning of the index_region memory, 
-                // but our actual index is probably somewhere in the middle of
-                // the block we read. So copy from the beginning of the index,
-                // not the whole block. This only matters for the first block.
-                memcpy(ptr, bh->b_data + index_offset, bytes_per_block - index_offset);
-                ptr += (bytes_per_block - index_offset);
-            } else {
-                // If this is a subsequent block holding our index, then we know
-                // the entire block contains index data.
-                memcpy(ptr, bh->b_data, bytes_per_block);
-                ptr += bytes_per_block;
-            }
-            brelse(bh);
-        }
-        
-        cached_index_region = index_region;
+        sbi->index_region = index_region;
+        sfs_cache_set_memcg(sbi);
+        sfs_bloom_build(sb);
+    }
+
+    return sbi->index_region;
+}
+
+void put_index_region(struct super_block *sb)
+{
+    mutex_unlock(&SFS_INFO(sb)->index_lock);
+}
+
+/**
+ * sfs_read_entry copies a single index entry straight from disk. pos counts
+ * entries back from the end of the media, so the Volume ID entry is 1.
+ */
+int sfs_read_entry(struct super_block *sb, uint32_t pos, struct index_entry *found)
+{
+    superblock *s = SFS_SB(sb);
+    struct buffer_head *bh;
+    uint32_t bytes_per_block = 1 << (s->block_size + 7);
+    long long offset = (s->total_blocks * bytes_per_block) - ((long long)pos * INDEX_ENTRY_SIZE);
+
+    if (pos == 0 || pos > s->index_bytes / INDEX_ENTRY_SIZE) {
+        return -EINVAL;
+    }
+
+    bh = sb_bread(sb, offset / bytes_per_block);
+    if (bh == NULL) {
+        return -EIO;
     }
 
-    return cached_index_region;
+    memcpy(found, bh->b_data + (offset % bytes_per_block), sizeof(struct index_entry));
+    brelse(bh);
+
+    return 0;
 }
 
 /**
  * get_entry_by_name will locate an index entry by file|directory
- * name and return it.
+ * name and copy it into found. If pos isn't NULL it's set to the entry's
+ * position, as sfs_read_entry counts them. Images with an up to date name
+ * hash are resolved through it, everything else falls back to scanning
+ * the index.
  */
-index_entry *get_entry_by_name(struct super_block *sb, const unsigned char *name)
+int get_entry_by_name(struct super_block *sb, const unsigned char *name,
+        struct index_entry *found, uint32_t *pos)
 {
-    uint8_t i;
+    struct sfs_sb_info *sbi = SFS_INFO(sb);
+    unsigned int i;
     char *index_region;
     struct index_entry *ientry;
+    int maybe;
+    int err = -ENOENT;
+
+    // Most names that are probed for but don't exist are rejected here,
+    // without a hash table read or an index scan.
+    mutex_lock(&sbi->index_lock);
+    maybe = sfs_bloom_may_contain(sb, name);
+    mutex_unlock(&sbi->index_lock);
+    if (!maybe) {
+        return -ENOENT;
+    }
+
+    if (sfs_has_name_hash(SFS_SB(sb))) {
+        return sfs_hash_lookup(sb, name, found, pos);
+    }
 
     index_region = get_index_region(sb);
     if (index_region==NULL) {
         printk(KERN_ERR "SFS: Could not find index region\n");
-        return 0;
+        return -ENOMEM;
     }
 
     for (i=0; i<(SFS_SB(sb)->index_bytes / INDEX_ENTRY_SIZE)+1;i++) {
@@ -83,39 +150,56 @@ index_entry *get_entry_by_name(struct super_block *sb, const unsigned char *name
             break;
         } else if (ientry->type == DIRECTORY_ENTRY) {
             if (strcmp(ientry->dir.dir_name, name)==0) {
-                return ientry;
+                memcpy(found, ientry, sizeof(struct index_entry));
+                err = 0;
+                break;
             }
         } else if (ientry->type == FILE_ENTRY) {
             if (strcmp(ientry->file.file_name, name)==0) {
-                return ientry;
+                memcpy(found, ientry, sizeof(struct index_entry));
+                err = 0;
+                break;
             }
         }
 
     }
 
-    return NULL;
+    if (err == 0 && pos != NULL) {
+        *pos = (SFS_SB(sb)->index_bytes / INDEX_ENTRY_SIZE) - i;
+    }
+
+    put_index_region(sb);
+    return err;
 }
 
 /**
  * sfs_read will read a file and copy data into userspace. This is
- * called when a file is open(2)'d and read(2) from.
+ * called when a file is open(2)'d and read(2) from. The file's index
+ * entry was copied into the inode at lookup, so no lookup happens here.
  */
 ssize_t sfs_read(struct file * filp, char __user * buf, size_t len,
 		      loff_t * ppos)
 {
     struct buffer_head *bh;
-    struct index_entry *entry;
+    struct index_entry *entry = &SFS_I(file_inode(filp))->entry;
     struct super_block *sb = filp->f_inode->i_sb;
     superblock *s = SFS_SB(sb);
+    uint32_t bytes_per_block = 1 << (s->block_size + 7);
+    sector_t data_block;
+    unsigned int offset;
+    size_t chunk;
+    ssize_t done = 0;
+    const char *preloaded;
+    int err;
 
-    entry = get_entry_by_name(sb, filp->f_path.dentry->d_name.name);
-    if (entry==NULL) {
-        printk(KERN_ERR "SFS: Could not find entry for %s\n", filp->f_path.dentry->d_name.name);
+    if (entry->type != FILE_ENTRY) {
         return -EINVAL;
     }
 
-    // Update the inode's last access time.
-    filp->f_inode->i_atime = CURRENT_TIME;
+    // The VFS decides whether the access time changes at all, honoring
+    // noatime and relatime. With lazytime it's only kept in memory until
+    // writeback stores it in the index.
+    file_accessed(filp);
 
     if (*ppos >= entry->file.length) {
         return 0;
@@ -125,23 +209,50 @@ ssize_t sfs_read(struct file * filp, char __user * buf, size_t len,
         len = entry->file.length - *ppos;
     }
 
-    bh = sb_bread(sb, entry->file.starting_block + s->reserved_blocks);
-    if (bh==NULL) {
-        printk(KERN_ERR "SFS: Error reading %s\n", filp->f_path.dentry->d_name.name);
-        return -EFAULT;
-    }
-    
-    if (copy_to_user(buf, (char*)bh->b_data, len) > 0) {
-        printk(KERN_ERR "SFS: Error writing bytes to buffer\n");
-        brelse(bh);
-        return -EFAULT;
+    // Small files may have been preloaded at mount
+    preloaded = sfs_preload_find(sb, entry);
+    if (preloaded != NULL) {
+        if (copy_to_user(buf, preloaded + *ppos, len) > 0) {
+            return -EFAULT;
+        }
+        *ppos += len;
+        return len;
     }
 
-    brelse(bh);
+    // Copy block by block, starting from the block holding *ppos.
+    while (len > 0) {
+        data_block = entry->file.starting_block + (*ppos / bytes_per_block);
+        offset = *ppos % bytes_per_block;
+        chunk = min_t(size_t, len, bytes_per_block - offset);
+
+        bh = sb_bread(sb, data_block + s->reserved_blocks);
+        if (bh==NULL) {
+            printk(KERN_ERR "SFS: Error reading %s\n", filp->f_path.dentry->d_name.name);
+            return done ? done : -EIO;
+        }
+
+        err = sfs_verify_block(sb, bh, data_block);
+        if (err) {
+            printk(KERN_ERR "SFS: Checksum mismatch in block %llu of %s\n",
+                    (unsigned long long)data_block, filp->f_path.dentry->d_name.name);
+            brelse(bh);
+            return done ? done : err;
+        }
+
+        if (copy_to_user(buf + done, (char*)bh->b_data + offset, chunk) > 0) {
+            printk(KERN_ERR "SFS: Error writing bytes to buffer\n");
+            brelse(bh);
+            return done ? done : -EFAULT;
+        }
 
-    *ppos += min((size_t)entry->file.length, len);
+        brelse(bh);
+
+        done += chunk;
+        len -= chunk;
+        *ppos += chunk;
+    }
 
-    return min((size_t)entry->file.length, len);
+    return done;
 }
 
 /**
@@ -153,8 +264,10 @@ ssize_t sfs_read(struct file * filp, char __user * buf, size_t len,
 static int sfs_read_dir(struct file *file, struct dir_context *ctx)
 {
     struct inode *inode = file_inode(file);
+    superblock *s = SFS_SB(inode->i_sb);
     char *index_region;
     struct index_entry *dir_entry;
+    uint32_t entries, pos;
 
     if (ctx->pos<2) {
         // Position 0 and 1 will be . and ..
@@ -171,27 +284,30 @@ static int sfs_read_dir(struct file *file, struct dir_context *ctx)
         return 0;
     }
 
-    // Find the next viable entry, or the final entry (volume_id_entry). This
-    // skips over any deleted records.
-    while (1) {
-        dir_entry = (struct index_entry *)(index_region + ((ctx->pos-2) * INDEX_ENTRY_SIZE));
+    // Past the dots, ctx->pos - 1 is the index position of the next entry,
+    // counted back from the end of the media. Positions don't move when
+    // the index grows, so a refresh between calls can't make an open
+    // directory skip or repeat entries; new ones just come last. Deleted
+    // and other records are skipped.
+    entries = s->index_bytes / INDEX_ENTRY_SIZE;
+    for (pos = ctx->pos - 1; pos <= entries; pos = ctx->pos - 1) {
+        dir_entry = (struct index_entry *)(index_region + s->index_bytes - ((long long)pos * INDEX_ENTRY_SIZE));
         if (dir_entry->type == DIRECTORY_ENTRY) {
             if (!dir_emit(ctx, dir_entry->dir.dir_name, 
                     strlen(dir_entry->dir.dir_name), inode->i_ino, DT_DIR)) {
-                return 0;
+                break;
             }
         } else if (dir_entry->type == FILE_ENTRY) {
             if (!dir_emit(ctx, dir_entry->file.file_name, 
                     strlen(dir_entry->file.file_name), inode->i_ino, DT_REG)) {
-                return 0;
+                break;
             }
-        }else if (dir_entry->type == VOLUME_ID_ENTRY) {
-            break;
         }
 
         ctx->pos++;
     }
 
+    put_index_region(inode->i_sb);
     return 0;
 }
 
@@ -201,6 +317,8 @@ const struct file_operations sfs_dir_operations = {
     .read = generic_read_dir,
     .iterate = sfs_read_dir,
     .llseek = dcache_dir_lseek,
+    .unlocked_ioctl = sfs_ioctl,
+    .compat_ioctl = sfs_ioctl,
 };
 
 const struct file_operations sfs_file_operations = {
@@ -1,13 +1,311 @@
 #include "../common/sfs_kern.h"
 
-static void sfs_put_super(struct super_block *sb) {
-    unsigned char *index_region = get_index_region(sb);
-    if (index_region!=NULL) {
-        kfree(index_region);
+// A mount's caches aren't offered to the shrinker until they have been idle
+// this long, so a burst of lookups doesn't keep reloading the index.
+#define SFS_CACHE_GRACE     HZ
+
+static unsigned long sfs_cache_pages(struct sfs_sb_info *sbi)
+{
+    unsigned long bytes = 0;
+
+    if (sbi->index_region != NULL) {
+        bytes += sbi->s.index_bytes;
     }
-    
-    if (SFS_SB(sb)!=NULL) {
-        kfree(SFS_SB(sb));
+    if (sbi->bloom != NULL) {
+        bytes += BITS_TO_LONGS(sbi->bloom_bits) * sizeof(unsigned long);
+    }
+
+    return DIV_ROUND_UP(bytes, PAGE_SIZE);
+}
+
+/**
+ * Remember the memory cgroup the caches are being charged to, the current
+ * task's, so reclaim on behalf of that cgroup can find them. Called with
+ * index_lock held whenever the index is allocated.
+ */
+void sfs_cache_set_memcg(struct sfs_sb_info *sbi)
+{
+#ifdef CONFIG_MEMCG
+    struct cgroup_subsys_state *css;
+
+    rcu_read_lock();
+    do {
+        css = task_css(current, memory_cgrp_id);
+    } while (!css_tryget(css));
+    rcu_read_unlock();
+
+    sfs_cache_put_memcg(sbi);
+    sbi->memcg = mem_cgroup_from_css(css);
+#endif
+}
+
+void sfs_cache_put_memcg(struct sfs_sb_info *sbi)
+{
+#ifdef CONFIG_MEMCG
+    if (sbi->memcg != NULL) {
+        css_put(&sbi->memcg->css);
+        sbi->memcg = NULL;
+    }
+#endif
+}
+
+/**
+ * Report how many pages the cached index and name filter hold. Each mount
+ * is a single object as far as reclaim is concerned, it's either cached
+ * or it isn't. Reclaim for one memory cgroup only counts the caches when
+ * they are charged to that cgroup.
+ */
+static unsigned long sfs_cache_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+    struct sfs_sb_info *sbi = container_of(shrink, struct sfs_sb_info, shrinker);
+
+#ifdef CONFIG_MEMCG
+    if (sc->memcg != NULL && sc->memcg != ACCESS_ONCE(sbi->memcg)) {
+        return 0;
+    }
+#endif
+
+    if (time_before(jiffies, ACCESS_ONCE(sbi->index_used) + SFS_CACHE_GRACE)) {
+        return 0;
+    }
+
+    return sfs_cache_pages(sbi);
+}
+
+/**
+ * Drop the cached index and name filter. The next lookup or readdir loads
+ * them again, and images with a name hash resolve lookups without them.
+ */
+static unsigned long sfs_cache_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+    struct sfs_sb_info *sbi = container_of(shrink, struct sfs_sb_info, shrinker);
+    unsigned long freed;
+
+    // Reclaim can be entered with index_lock held by an allocation in
+    // get_index_region, so never wait for it here.
+    if (!mutex_trylock(&sbi->index_lock)) {
+        return SHRINK_STOP;
+    }
+
+    freed = sfs_cache_pages(sbi);
+    kfree(sbi->index_region);
+    vfree(sbi->bloom);
+    sbi->index_region = NULL;
+    sbi->bloom = NULL;
+    sbi->bloom_bits = 0;
+    mutex_unlock(&sbi->index_lock);
+
+    return freed;
+}
+
+int sfs_register_shrinker(struct super_block *sb)
+{
+    struct sfs_sb_info *sbi = SFS_INFO(sb);
+    int err;
+
+    sbi->shrinker.count_objects = sfs_cache_count;
+    sbi->shrinker.scan_objects = sfs_cache_scan;
+    sbi->shrinker.seeks = DEFAULT_SEEKS;
+#ifdef CONFIG_MEMCG
+    // Called per cgroup, with sc->memcg set, on cgroup and global reclaim
+    // alike once kernel memory accounting is on, and with it NULL when off.
+    sbi->shrinker.flags = SHRINKER_MEMCG_AWARE;
+#endif
+
+    err = register_shrinker(&sbi->shrinker);
+    if (err == 0) {
+        sbi->shrinker_registered = 1;
+    }
+
+    return err;
+}
+
+static struct kmem_cache *sfs_inode_cachep;
+
+static struct inode *sfs_alloc_inode(struct super_block *sb)
+{
+    struct sfs_inode_info *ei = kmem_cache_alloc(sfs_inode_cachep, GFP_KERNEL);
+
+    if (ei == NULL) {
+        return NULL;
+    }
+
+    ei->pos = 0;
+    memset(&ei->entry, 0, sizeof(struct index_entry));
+    return &ei->vfs_inode;
+}
+
+static void sfs_i_callback(struct rcu_head *head)
+{
+    struct inode *inode = container_of(head, struct inode, i_rcu);
+    kmem_cache_free(sfs_inode_cachep, SFS_I(inode));
+}
+
+static void sfs_destroy_inode(struct inode *inode)
+{
+    call_rcu(&inode->i_rcu, sfs_i_callback);
+}
+
+static void sfs_init_once(void *foo)
+{
+    struct sfs_inode_info *ei = foo;
+    inode_init_once(&ei->vfs_inode);
+}
+
+int sfs_init_inodecache(void)
+{
+    sfs_inode_cachep = kmem_cache_create("sfs_inode_cache", sizeof(struct sfs_inode_info),
+            0, SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD, sfs_init_once);
+    if (sfs_inode_cachep == NULL) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void sfs_destroy_inodecache(void)
+{
+    // Make sure all delayed rcu free inodes are flushed first
+    rcu_barrier();
+    kmem_cache_destroy(sfs_inode_cachep);
+}
+
+/**
+ * Store an inode's access time in the timestamp of its index entry. This
+ * runs from writeback, so any number of reads between two writebacks cost
+ * a single block update. Mounts without atime updates never get here.
+ * The block is what counts, the cached index is only kept in step. When
+ * may_wait is 0 that's skipped rather than wait for index_lock.
+ */
+static int sfs_store_atime(struct inode *inode, struct writeback_control *wbc, int may_wait)
+{
+    struct super_block *sb = inode->i_sb;
+    struct sfs_sb_info *sbi = SFS_INFO(sb);
+    superblock *s = SFS_SB(sb);
+    uint32_t pos = SFS_I(inode)->pos;
+    uint32_t bytes_per_block = 1 << (s->block_size + 7);
+    long long offset = (s->total_blocks * bytes_per_block) - ((long long)pos * INDEX_ENTRY_SIZE);
+    long long timestamp = (inode->i_atime.tv_sec * 1000LL) + (inode->i_atime.tv_nsec / 1000000);
+    struct index_entry *ientry;
+    struct buffer_head *bh;
+    int err = 0;
+
+    if (pos == 0 || pos > s->index_bytes / INDEX_ENTRY_SIZE) {
+        return 0;
+    }
+
+    bh = sb_bread(sb, offset / bytes_per_block);
+    if (bh == NULL) {
+        return -EIO;
+    }
+
+    // The buffer lock keeps a refresh from rereading the block between
+    // the update and it being marked dirty.
+    lock_buffer(bh);
+    ientry = (struct index_entry *)(bh->b_data + (offset % bytes_per_block));
+    if (ientry->type == DIRECTORY_ENTRY) {
+        ientry->dir.timestamp = timestamp;
+    } else if (ientry->type == FILE_ENTRY) {
+        ientry->file.timestamp = timestamp;
+    } else {
+        unlock_buffer(bh);
+        brelse(bh);
+        return 0;
+    }
+
+    mark_buffer_dirty(bh);
+    unlock_buffer(bh);
+    if (wbc->sync_mode == WB_SYNC_ALL) {
+        sync_dirty_buffer(bh);
+        if (buffer_req(bh) && !buffer_uptodate(bh)) {
+            err = -EIO;
+        }
+    }
+    brelse(bh);
+
+    // Keep the cached index in step, if it's loaded
+    if (may_wait) {
+        mutex_lock(&sbi->index_lock);
+    } else if (!mutex_trylock(&sbi->index_lock)) {
+        return err;
+    }
+    if (sbi->index_region != NULL) {
+        ientry = (struct index_entry *)(sbi->index_region + s->index_bytes - ((long long)pos * INDEX_ENTRY_SIZE));
+        if (ientry->type == DIRECTORY_ENTRY) {
+            ientry->dir.timestamp = timestamp;
+        } else if (ientry->type == FILE_ENTRY) {
+            ientry->file.timestamp = timestamp;
+        }
+    }
+    mutex_unlock(&sbi->index_lock);
+
+    return err;
+}
+
+static int sfs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+    return sfs_store_atime(inode, wbc, 1);
+}
+
+/**
+ * Inodes are dropped as soon as their last reference goes, so an access
+ * time that hasn't been written back yet is stored on the way out.
+ * Eviction can come from reclaim entered by an allocation made under
+ * index_lock, so it never waits for that lock.
+ */
+static void sfs_evict_inode(struct inode *inode)
+{
+    struct writeback_control wbc = {
+        .sync_mode = WB_SYNC_NONE,
+    };
+
+    truncate_inode_pages_final(&inode->i_data);
+    if (inode->i_state & (I_DIRTY | I_DIRTY_TIME)) {
+        sfs_store_atime(inode, &wbc, 0);
+    }
+    clear_inode(inode);
+}
+
+/**
+ * Remounting with the refresh option picks up anything appended to the
+ * image since it was mounted, without dropping what's cached. Preloaded
+ * files may be in use by readers, so the preload options can't change.
+ */
+static int sfs_remount(struct super_block *sb, int *flags, char *data)
+{
+    struct sfs_sb_info *sbi = SFS_INFO(sb);
+    struct sfs_mount_opts opts = {
+        .preload_max = sbi->preload_max,
+        .preload_total = sbi->preload_total,
+    };
+
+    if (sfs_parse_options(data, sb, &opts)) {
+        return -EINVAL;
+    }
+    if (opts.preload_max != sbi->preload_max || opts.preload_total != sbi->preload_total) {
+        printk(KERN_ERR "SFS: Preload options can't be changed on remount\n");
+        return -EINVAL;
+    }
+
+    sync_filesystem(sb);
+    if (opts.refresh) {
+        return sfs_refresh_index(sb);
+    }
+    return 0;
+}
+
+static void sfs_put_super(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_INFO(sb);
+
+    if (sbi!=NULL) {
+        if (sbi->shrinker_registered) {
+            unregister_shrinker(&sbi->shrinker);
+        }
+        kfree(sbi->index_region);
+        vfree(sbi->bloom);
+        sfs_cache_put_memcg(sbi);
+        sfs_preload_free(sbi);
+        kfree(sbi);
+        sb->s_fs_info = NULL;
     }
 
     printk(KERN_INFO "SFS super block destroyed\n");
@@ -15,7 +313,7 @@ static void sfs_put_super(struct super_block *sb) {
 
 static int sfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
-    superblock *s = dentry->d_sb->s_fs_info;
+    superblock *s = SFS_SB(dentry->d_sb);
     
     buf->f_type = SFS_MAGIC_NUMBER;
     buf->f_bsize = 1 << (s->block_size + 7);
@@ -28,7 +326,12 @@ static int sfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 }
 
 const struct super_operations const sfs_super_ops = {
-    .put_super  = sfs_put_super,
-    .statfs     = sfs_statfs,
-    .drop_inode = generic_delete_inode,
+    .alloc_inode    = sfs_alloc_inode,
+    .destroy_inode  = sfs_destroy_inode,
+    .write_inode    = sfs_write_inode,
+    .evict_inode    = sfs_evict_inode,
+    .put_super      = sfs_put_super,
+    .remount_fs     = sfs_remount,
+    .statfs         = sfs_statfs,
+    .drop_inode     = generic_delete_inode,
 };